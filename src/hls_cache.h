@@ -0,0 +1,530 @@
+/*******************************************************************************
+ hls_cache.h - A shared memory LRU cache for indexes and responses.
+
+ For licensing see the LICENSE file
+******************************************************************************/
+
+struct hls_cache_node_t {
+  ngx_str_node_t sn;            // key and crc32 of the key
+  ngx_queue_t queue;            // lru, most recently used first
+  ngx_uint_t refs;              // requests using the data, never evicted
+  ngx_pid_t pid;                // the worker that stores the data or holds the lock
+  ngx_uint_t generation;        // tells the node apart from earlier ones for the key
+  ngx_uint_t uncacheable;       // a lock whose entry could not be stored
+  size_t size;
+  u_char *data;
+};
+typedef struct hls_cache_node_t hls_cache_node_t;
+
+struct hls_cache_sh_t {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t queue;
+
+  ngx_uint_t entries;
+  size_t size;
+  ngx_uint_t hits;
+  ngx_uint_t misses;
+  ngx_uint_t evictions;
+  ngx_uint_t generation;
+};
+typedef struct hls_cache_sh_t hls_cache_sh_t;
+
+struct hls_cache_t {
+  hls_cache_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+};
+typedef struct hls_cache_t hls_cache_t;
+
+struct hls_cache_cleanup_t {
+  ngx_shm_zone_t *zone;
+  hls_cache_node_t *node;
+};
+typedef struct hls_cache_cleanup_t hls_cache_cleanup_t;
+
+struct hls_cache_lock_t {
+  ngx_shm_zone_t *zone;         // NULL once released
+  ngx_str_t key;
+  ngx_uint_t generation;
+};
+typedef struct hls_cache_lock_t hls_cache_lock_t;
+
+static ngx_int_t hls_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  hls_cache_t *ocache = data;
+  hls_cache_t *cache = shm_zone->data;
+  size_t len;
+
+  if(ocache) {
+    cache->sh = ocache->sh;
+    cache->shpool = ocache->shpool;
+    return NGX_OK;
+  }
+
+  cache->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+  if(shm_zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
+
+  cache->sh = ngx_slab_calloc(cache->shpool, sizeof(hls_cache_sh_t));
+  if(cache->sh == NULL) return NGX_ERROR;
+
+  cache->shpool->data = cache->sh;
+
+  ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->sh->queue);
+
+  len = sizeof(" in hls cache zone \"\"") + shm_zone->shm.name.len;
+
+  cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+  if(cache->shpool->log_ctx == NULL) return NGX_ERROR;
+
+  ngx_sprintf(cache->shpool->log_ctx, " in hls cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+  // eviction makes room, running out of memory is expected
+  cache->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+// every key starts with the identity of the mp4 file, so a replaced or
+// modified file never hits an old entry.
+static ngx_int_t hls_cache_key(ngx_http_request_t *r, ngx_str_t *key, u_char type,
+                               ngx_str_t const *path, ngx_open_file_info_t const *of,
+                               ngx_str_t const *extra) {
+  size_t len = 2 + 3 * (NGX_INT64_LEN + 1) + path->len + (extra ? 1 + extra->len : 0);
+
+  key->data = ngx_pnalloc(r->pool, len);
+  if(key->data == NULL) return 0;
+
+  u_char *p = ngx_sprintf(key->data, "%c:%uL:%O:%T:%V", type, (uint64_t)of->uniq, of->size, of->mtime, path);
+  if(extra) p = ngx_sprintf(p, ":%V", extra);
+  key->len = p - key->data;
+
+  return 1;
+}
+
+static void hls_cache_cleanup(void *data) {
+  hls_cache_cleanup_t *cln = data;
+  hls_cache_t *cache = cln->zone->data;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  --cln->node->refs;
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+// counts a hit or a miss of something that is not kept in the zone itself
+static void hls_cache_count(ngx_shm_zone_t *zone, ngx_flag_t hit) {
+  hls_cache_t *cache = zone->data;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  if(hit) ++cache->sh->hits;
+  else ++cache->sh->misses;
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+// Called locked.
+static void hls_cache_delete(hls_cache_t *cache, hls_cache_node_t *node) {
+  ngx_queue_remove(&node->queue);
+  ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+  if(node->data) {
+    --cache->sh->entries;
+    cache->sh->size -= node->size;
+  }
+  ngx_slab_free_locked(cache->shpool, node);
+}
+
+// an entry without data whose worker has exited is never stored or
+// unlocked. Called locked.
+static ngx_uint_t hls_cache_orphan(hls_cache_t *cache, hls_cache_node_t *node) {
+  if(node->data || node->pid == ngx_pid) return 0;
+  if(kill(node->pid, 0) == 0 || ngx_errno != NGX_ESRCH) return 0;
+
+  hls_cache_delete(cache, node);
+  return 1;
+}
+
+// returns the entry for key, which stays valid until the request is done.
+static hls_cache_node_t *hls_cache_lookup(ngx_http_request_t *r, ngx_shm_zone_t *zone, ngx_str_t *key) {
+  hls_cache_t *cache = zone->data;
+  uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, sizeof(hls_cache_cleanup_t));
+  if(cln == NULL) return NULL;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  hls_cache_node_t *node = (hls_cache_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if(node && hls_cache_orphan(cache, node)) node = NULL;
+  if(node == NULL || node->data == NULL) {
+    // entries still being built are not counted until they are there
+    if(node == NULL) ++cache->sh->misses;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NULL;
+  }
+
+  ++node->refs;
+  ++cache->sh->hits;
+  ngx_queue_remove(&node->queue);
+  ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  hls_cache_cleanup_t *hcln = cln->data;
+  hcln->zone = zone;
+  hcln->node = node;
+  cln->handler = hls_cache_cleanup;
+
+  return node;
+}
+
+// drops the least recently used entry nobody is reading. Called locked.
+static ngx_uint_t hls_cache_evict(hls_cache_t *cache) {
+  ngx_queue_t *q;
+
+  for(q = ngx_queue_last(&cache->sh->queue);
+      q != ngx_queue_sentinel(&cache->sh->queue);
+      q = ngx_queue_prev(q)) {
+    hls_cache_node_t *node = ngx_queue_data(q, hls_cache_node_t, queue);
+    if(node->refs) continue;
+
+    if(node->data) ++cache->sh->evictions;
+    hls_cache_delete(cache, node);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+static hls_cache_node_t *hls_cache_alloc(hls_cache_t *cache, ngx_str_t *key, uint32_t hash, size_t size) {
+  size_t n = ngx_align(sizeof(hls_cache_node_t) + key->len, 8);
+  hls_cache_node_t *node;
+
+  while((node = ngx_slab_alloc_locked(cache->shpool, n + size)) == NULL) {
+    if(!hls_cache_evict(cache)) return NULL;
+  }
+
+  node->sn.node.key = hash;
+  node->sn.str.len = key->len;
+  node->sn.str.data = (u_char *)node + sizeof(hls_cache_node_t);
+  ngx_memcpy(node->sn.str.data, key->data, key->len);
+  node->refs = 0;
+  node->pid = ngx_pid;
+  node->generation = ++cache->sh->generation;
+  node->uncacheable = 0;
+  node->size = size;
+  node->data = size ? (u_char *)node + n : NULL;
+
+  ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+  ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+  return node;
+}
+
+// releases the lock once the entry is stored, or couldn't be built. If it
+// couldn't be stored, the lock stays until the request is done to tell the
+// requests that wait for it to build the segment themselves.
+static void hls_cache_unlock(hls_cache_lock_t *lock, ngx_flag_t uncacheable) {
+  if(lock == NULL || lock->zone == NULL) return;
+
+  hls_cache_t *cache = lock->zone->data;
+  uint32_t hash = ngx_crc32_short(lock->key.data, lock->key.len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  // the entry may be there by now, or the lock may have been evicted and the
+  // key locked again by another request
+  hls_cache_node_t *node = (hls_cache_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->key, hash);
+  if(node && node->generation != lock->generation) node = NULL;
+
+  if(!uncacheable) {
+    if(node && node->data == NULL && node->refs == 0) hls_cache_delete(cache, node);
+    lock->zone = NULL;
+  } else {
+    // storing the entry took the lock out of the zone
+    if(node == NULL && ngx_str_rbtree_lookup(&cache->sh->rbtree, &lock->key, hash) == NULL)
+      node = hls_cache_alloc(cache, &lock->key, hash, 0);
+    if(node && node->data == NULL && node->refs == 0) {
+      node->uncacheable = 1;
+      lock->generation = node->generation;
+    }
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static void hls_cache_lock_cleanup(void *data) {
+  hls_cache_unlock(data, 0);
+}
+
+// takes the lock for building the entry for key, which is held until
+// hls_cache_unlock or the end of the request. Returns NGX_OK when the caller
+// should build the entry, NGX_AGAIN while another request builds it and
+// NGX_DECLINED once it is there. lock is NULL unless the lock was taken.
+static ngx_int_t hls_cache_lock(ngx_http_request_t *r, ngx_shm_zone_t *zone, ngx_str_t *key,
+                                hls_cache_lock_t **lock) {
+  hls_cache_t *cache = zone->data;
+  uint32_t hash = ngx_crc32_short(key->data, key->len);
+
+  *lock = NULL;
+
+  ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, sizeof(hls_cache_lock_t));
+  if(cln == NULL) return NGX_OK;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  hls_cache_node_t *node = (hls_cache_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if(node && hls_cache_orphan(cache, node)) node = NULL;
+  if(node) {
+    // the node may be evicted as soon as the zone is unlocked. An entry that
+    // doesn't fit is built by every request on its own.
+    ngx_int_t rc = node->data ? NGX_DECLINED : node->uncacheable ? NGX_OK : NGX_AGAIN;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return rc;
+  }
+
+  // a lock is an entry without data
+  node = hls_cache_alloc(cache, key, hash, 0);
+  ngx_uint_t generation = node ? node->generation : 0;
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  if(node) {
+    *lock = cln->data;
+    (*lock)->zone = zone;
+    (*lock)->key = *key;
+    (*lock)->generation = generation;
+    cln->handler = hls_cache_lock_cleanup;
+  }
+
+  return NGX_OK;
+}
+
+// stores the size bytes in the bufs of in
+static ngx_int_t hls_cache_insert_chain(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_chain_t const *in, size_t size) {
+  hls_cache_t *cache = zone->data;
+  uint32_t hash = ngx_crc32_short(key->data, key->len);
+  size_t n = ngx_align(sizeof(hls_cache_node_t) + key->len, 8);
+
+  // one entry may not flush the whole zone
+  if(n + size > (size_t)(cache->shpool->end - cache->shpool->start) / 4) return NGX_DECLINED;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  hls_cache_node_t *node = (hls_cache_node_t *)ngx_str_rbtree_lookup(&cache->sh->rbtree, key, hash);
+  if(node && hls_cache_orphan(cache, node)) node = NULL;
+  // there, or being stored by another request
+  if(node && (node->data || node->refs)) {
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+  }
+
+  // replaces the lock
+  if(node) hls_cache_delete(cache, node);
+
+  node = hls_cache_alloc(cache, key, hash, size);
+  if(node == NULL) {
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_DECLINED;
+  }
+
+  // until the data is copied the entry is a lock that can't be evicted, so
+  // the zone is not held for the copy. If the worker exits before it is
+  // done, the entry is reclaimed by the next one to find it.
+  u_char *data = node->data;
+  node->data = NULL;
+  node->refs = 1;
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  u_char *p = data;
+  for(; in; in = in->next) p = ngx_cpymem(p, in->buf->pos, in->buf->last - in->buf->pos);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  node->data = data;
+  --node->refs;
+  ++cache->sh->entries;
+  cache->sh->size += size;
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return NGX_OK;
+}
+
+static ngx_int_t hls_cache_insert(ngx_shm_zone_t *zone, ngx_str_t *key, u_char const *data, size_t size) {
+  ngx_buf_t b;
+  ngx_chain_t in = { &b, NULL };
+
+  b.pos = (u_char *)data;
+  b.last = b.pos + size;
+
+  return hls_cache_insert_chain(zone, key, &in, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// zone=name:size | off
+static char *ngx_http_hls_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  hls_main_conf_t *hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_streaming_module);
+  ngx_shm_zone_t **zone = (ngx_shm_zone_t **)((char *)conf + cmd->offset);
+  ngx_str_t *value = cf->args->elts;
+  ngx_str_t name, s;
+  ssize_t size = 0;
+  u_char *p;
+
+  if(*zone != NGX_CONF_UNSET_PTR) return "is duplicate";
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    *zone = NULL;
+    return NGX_CONF_OK;
+  }
+
+  if(ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  name.data = value[1].data + 5;
+  p = (u_char *)ngx_strchr(name.data, ':');
+
+  if(p) {
+    name.len = p - name.data;
+    s.data = p + 1;
+    s.len = value[1].data + value[1].len - s.data;
+
+    size = ngx_parse_size(&s);
+    if(size == NGX_ERROR) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+
+    if(size < (ssize_t)(8 * ngx_pagesize)) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+  } else {
+    name.len = value[1].len - 5;
+  }
+
+  if(name.len == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone name \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  *zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_streaming_module);
+  if(*zone == NULL) return NGX_CONF_ERROR;
+
+  if((*zone)->data == NULL) {
+    hls_cache_t *cache = ngx_pcalloc(cf->pool, sizeof(hls_cache_t));
+    if(cache == NULL) return NGX_CONF_ERROR;
+
+    (*zone)->init = hls_cache_init_zone;
+    (*zone)->data = cache;
+
+    ngx_shm_zone_t **zonep = ngx_array_push(&hmcf->caches);
+    if(zonep == NULL) return NGX_CONF_ERROR;
+    *zonep = *zone;
+  }
+
+  return NGX_CONF_OK;
+}
+
+// on | off. The hits and misses of all workers are kept in a zone of their own.
+static char *ngx_http_hls_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  hls_main_conf_t *hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_streaming_module);
+  hls_conf_t *hlcf = conf;
+  ngx_str_t name = ngx_string("hls_prefetch");
+
+  char *rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+  if(rv != NGX_CONF_OK || !hlcf->prefetch || hmcf->prefetch) return rv;
+
+  hmcf->prefetch = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_streaming_module);
+  if(hmcf->prefetch == NULL) return NGX_CONF_ERROR;
+
+  hls_cache_t *cache = ngx_pcalloc(cf->pool, sizeof(hls_cache_t));
+  if(cache == NULL) return NGX_CONF_ERROR;
+
+  hmcf->prefetch->init = hls_cache_init_zone;
+  hmcf->prefetch->data = cache;
+
+  return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_hls_status_handler(ngx_http_request_t *r) {
+  hls_main_conf_t *hmcf = ngx_http_get_module_main_conf(r, ngx_http_streaming_module);
+  ngx_shm_zone_t **zones = hmcf->caches.elts;
+  size_t size = 0;
+  ngx_uint_t i;
+  ngx_int_t rc;
+
+  if(!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+    return NGX_HTTP_NOT_ALLOWED;
+
+  rc = ngx_http_discard_request_body(r);
+
+  if(rc != NGX_OK)
+    return rc;
+
+  for(i = 0; i < hmcf->caches.nelts; ++i) {
+    size += sizeof(": entries  size  hits  misses  evictions \n") - 1 +
+            zones[i]->shm.name.len + 5 * NGX_ATOMIC_T_LEN;
+  }
+  if(hmcf->prefetch) size += sizeof("prefetch: hits  misses \n") - 1 + 2 * NGX_ATOMIC_T_LEN;
+
+  ngx_buf_t *b = ngx_create_temp_buf(r->pool, size ? size : 1);
+  if(b == NULL) return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+  for(i = 0; i < hmcf->caches.nelts; ++i) {
+    hls_cache_t *cache = zones[i]->data;
+    hls_cache_sh_t sh;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    sh = *cache->sh;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    b->last = ngx_sprintf(b->last, "%V: entries %ui size %uz hits %ui misses %ui evictions %ui\n",
+                          &zones[i]->shm.name, sh.entries, sh.size, sh.hits, sh.misses, sh.evictions);
+  }
+
+  // segments whose samples were all in memory when they were read
+  if(hmcf->prefetch) {
+    hls_cache_t *cache = hmcf->prefetch->data;
+    hls_cache_sh_t sh;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    sh = *cache->sh;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    b->last = ngx_sprintf(b->last, "prefetch: hits %ui misses %ui\n", sh.hits, sh.misses);
+  }
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  ngx_str_set(&r->headers_out.content_type, "text/plain");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+  rc = ngx_http_send_header(r);
+
+  if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) return rc;
+
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+
+  ngx_chain_t out = { b, NULL };
+
+  return ngx_http_output_filter(r, &out);
+}
+
+static char *ngx_http_hls_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_core_loc_conf_t *clcf =
+    ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+  clcf->handler = ngx_http_hls_status_handler;
+
+  return NGX_CONF_OK;
+}
+
+// End Of File
@@ -0,0 +1,262 @@
+/*******************************************************************************
+ hls_uring.h - Reads files through an io_uring of the worker process.
+
+ For licensing see the LICENSE file
+******************************************************************************/
+
+#if (NGX_HLS_IO_URING)
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// reads in flight of all requests of a worker
+#define HLS_URING_ENTRIES 256
+
+struct hls_uring_io_t;
+
+struct hls_uring_read_t {
+  struct hls_uring_io_t *io;
+  u_char *buf;
+  size_t size;
+  off_t pos;
+  ssize_t bytes;                // read so far, or NGX_ERROR
+};
+typedef struct hls_uring_read_t hls_uring_read_t;
+
+// a batch of reads of one file, handler is called once all of them are done
+struct hls_uring_io_t {
+  ngx_fd_t fd;
+  hls_uring_read_t *reads;
+  ngx_uint_t nreads;
+  ngx_uint_t pending;
+  void (*handler)(struct hls_uring_io_t *io);
+  void *data;
+  ngx_log_t *log;
+};
+typedef struct hls_uring_io_t hls_uring_io_t;
+
+struct hls_uring_t {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned cq_entries;
+  unsigned to_submit;
+  unsigned inflight;            // queued reads whose completion is not in yet
+  ngx_connection_t *c;          // of the eventfd completions are signalled on
+};
+typedef struct hls_uring_t hls_uring_t;
+
+static hls_uring_t *hls_uring;
+static ngx_flag_t hls_uring_failed;
+
+static void hls_uring_event_handler(ngx_event_t *ev);
+
+static int hls_uring_enter(hls_uring_t *ring, unsigned to_submit) {
+  return syscall(__NR_io_uring_enter, ring->fd, to_submit, 0, 0, NULL, 0);
+}
+
+// sets up the ring the first time it is needed. A kernel without io_uring, or
+// with it disabled, leaves the reads to ngx_read_file.
+static hls_uring_t *hls_uring_get(ngx_log_t *log) {
+  struct io_uring_params p;
+  hls_uring_t *ring;
+  int efd = -1;
+
+  if(hls_uring || hls_uring_failed) return hls_uring;
+  hls_uring_failed = 1;
+
+  ring = ngx_pcalloc(ngx_cycle->pool, sizeof(hls_uring_t));
+  if(ring == NULL) return NULL;
+
+  ngx_memzero(&p, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, HLS_URING_ENTRIES, &p);
+  if(ring->fd == -1) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "io_uring_setup() failed, hls_io_uring is not used");
+    return NULL;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  u_char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  u_char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "mmap() of io_uring failed, hls_io_uring is not used");
+    goto failed;
+  }
+
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring->cq_entries = p.cq_entries;
+
+  // completions are signalled on an eventfd in the event loop, like file AIO
+  efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(efd == -1) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "eventfd() failed, hls_io_uring is not used");
+    goto failed;
+  }
+
+  if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &efd, 1) == -1) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "io_uring_register() failed, hls_io_uring is not used");
+    goto failed;
+  }
+
+  ring->c = ngx_get_connection(efd, ngx_cycle->log);
+  if(ring->c == NULL) goto failed;
+
+  ring->c->data = ring;
+  ring->c->read->handler = hls_uring_event_handler;
+  ring->c->read->log = ngx_cycle->log;
+
+  if(ngx_add_event(ring->c->read, NGX_READ_EVENT, NGX_CLEAR_EVENT) != NGX_OK) {
+    ngx_free_connection(ring->c);
+    goto failed;
+  }
+
+  hls_uring = ring;
+  hls_uring_failed = 0;
+  return ring;
+
+failed:
+  if(efd != -1) close(efd);
+  close(ring->fd);
+  return NULL;
+}
+
+// queues a read. No more reads are in flight than the completion ring holds,
+// so that no completion is dropped on an overflow.
+static ngx_int_t hls_uring_queue(hls_uring_t *ring, hls_uring_read_t *rd) {
+  unsigned tail = *ring->sq_tail;
+
+  if(ring->inflight >= ring->cq_entries) return NGX_AGAIN;
+
+  if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask) {
+    // the ring is full, what is in it goes to the kernel first
+    int n = hls_uring_enter(ring, ring->to_submit);
+    if(n == -1) return NGX_ERROR;
+    ring->to_submit -= n;
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask) return NGX_AGAIN;
+  }
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = rd->io->fd;
+  sqe->addr = (uintptr_t)(rd->buf + rd->bytes);
+  sqe->len = rd->size - rd->bytes;
+  sqe->off = rd->pos + rd->bytes;
+  sqe->user_data = (uintptr_t)rd;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->to_submit;
+  ++ring->inflight;
+
+  return NGX_OK;
+}
+
+// submits all reads of io in one call. Returns NGX_AGAIN if io->handler is
+// called once they are done, NGX_DECLINED if the caller has to read itself.
+static ngx_int_t hls_uring_submit(hls_uring_io_t *io) {
+  hls_uring_t *ring = hls_uring_get(io->log);
+  ngx_uint_t i;
+  int n;
+
+  if(ring == NULL) return NGX_DECLINED;
+
+  unsigned tail = *ring->sq_tail, inflight = ring->inflight;
+
+  for(i = 0; i < io->nreads; ++i) {
+    io->reads[i].io = io;
+    io->reads[i].bytes = 0;
+    if(hls_uring_queue(ring, &io->reads[i]) != NGX_OK) {
+      // the kernel still gets the ones that are queued
+      if(i == 0) return NGX_DECLINED;
+      break;
+    }
+  }
+  io->pending = i;
+
+  n = hls_uring_enter(ring, ring->to_submit);
+  if(n == -1) {
+    ngx_log_error(NGX_LOG_ALERT, io->log, ngx_errno, "io_uring_enter() failed");
+
+    // as long as the kernel took none of the reads of io, they are taken
+    // back and read by the caller
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if((int)(head - tail) <= 0) {
+      __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+      ring->to_submit = tail - head;
+      ring->inflight = inflight;
+      return NGX_DECLINED;
+    }
+    // otherwise the kernel may own the buffers, so the rest is submitted
+    // once completions of other reads come in
+  } else ring->to_submit -= n;
+
+  // what did not fit in the ring is read now
+  for(; i < io->nreads; ++i) {
+    hls_uring_read_t *rd = &io->reads[i];
+    rd->bytes = pread(io->fd, rd->buf, rd->size, rd->pos);
+  }
+
+  return NGX_AGAIN;
+}
+
+static void hls_uring_event_handler(ngx_event_t *ev) {
+  ngx_connection_t *c = ev->data;
+  hls_uring_t *ring = c->data;
+  uint64_t n;
+
+  if(read(c->fd, &n, sizeof(n)) == -1 && ngx_errno != NGX_EAGAIN) {
+    ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno, "read() of io_uring eventfd failed");
+  }
+
+  unsigned head = *ring->cq_head;
+  while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    hls_uring_read_t *rd = (hls_uring_read_t *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    --ring->inflight;
+
+    if(res < 0) {
+      ngx_log_error(NGX_LOG_CRIT, rd->io->log, -res, "io_uring read of %uz at %O failed", rd->size, rd->pos);
+      rd->bytes = NGX_ERROR;
+    } else {
+      rd->bytes += res;
+      // a short read that is not at the end of the file goes on
+      if(res > 0 && (size_t)rd->bytes < rd->size && hls_uring_queue(ring, rd) == NGX_OK) continue;
+    }
+
+    if(--rd->io->pending == 0) rd->io->handler(rd->io);
+  }
+
+  if(ring->to_submit) {
+    int n = hls_uring_enter(ring, ring->to_submit);
+    if(n != -1) ring->to_submit -= n;
+  }
+}
+
+#endif
+
+// End Of File
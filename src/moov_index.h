@@ -0,0 +1,457 @@
+/*******************************************************************************
+ moov_index.h - Serialization of the indexed moov for the index cache.
+
+ For licensing see the LICENSE file
+******************************************************************************/
+
+// A serialized index is a moov_index_t and the segment table of the first
+// trak for the hls_length it was built with, followed, for every trak, by a
+// trak_index_t, the raw sample entry and the arrays of the sample index:
+// sizes, offsets, composition times (only with ctts), the sync bitset, the
+// chunks and the runs. Everything is native endian and padded to 8 bytes.
+
+#define MOOV_INDEX_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+struct moov_index_t {
+  uint32_t tracks_;
+  uint32_t timescale_;
+  uint64_t duration_;
+  uint32_t segments_length_;
+  uint32_t segments_size_;
+};
+typedef struct moov_index_t moov_index_t;
+
+struct trak_index_t {
+  uint32_t track_id_;
+  uint32_t handler_type_;
+  uint32_t timescale_;
+  uint32_t fourcc_;
+  uint64_t duration_;
+  uint32_t entry_len_;
+  uint32_t samples_size_;
+  uint32_t chunks_size_;
+  uint32_t runs_size_;
+  uint32_t ctos_;
+  uint32_t reserved_;
+  uint64_t end_pos_;
+};
+typedef struct trak_index_t trak_index_t;
+
+static size_t trak_index_arrays_size(uint32_t samples_size, uint32_t chunks_size,
+                                     uint32_t runs_size, uint32_t ctos) {
+  size_t size = 0;
+
+  size += 2 * MOOV_INDEX_ALIGN((size_t)samples_size * sizeof(uint32_t));
+  if(ctos) size += MOOV_INDEX_ALIGN(((size_t)samples_size + 1) * sizeof(uint32_t));
+  size += MOOV_INDEX_ALIGN(((size_t)samples_size / 32 + 1) * sizeof(uint32_t));
+  size += (size_t)chunks_size * sizeof(chunks_t);
+  size += (size_t)runs_size * sizeof(sample_run_t);
+
+  return size;
+}
+
+static size_t moov_index_size(moov_t const *moov) {
+  size_t size = sizeof(moov_index_t);
+  unsigned int i;
+
+  if(moov->segments_) size += MOOV_INDEX_ALIGN(moov->segments_size_ * sizeof(segment_t));
+
+  for(i = 0; i != moov->tracks_; ++i) {
+    trak_t const *trak = moov->traks_[i];
+    // nothing to restore the track from
+    if(!trak->mdia_->minf_->stbl_->stsd_->entries_) return 0;
+    size += sizeof(trak_index_t);
+    size += MOOV_INDEX_ALIGN(trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0].len_);
+    size += trak_index_arrays_size(trak->samples_size_, trak->chunks_size_,
+                                   trak->runs_size_, trak->sample_ctos_ != NULL);
+  }
+
+  return size;
+}
+
+static u_char *moov_index_put(u_char *buffer, void const *data, size_t size) {
+  memcpy(buffer, data, size);
+  memset(buffer + size, 0, MOOV_INDEX_ALIGN(size) - size);
+
+  return buffer + MOOV_INDEX_ALIGN(size);
+}
+
+static void *moov_index_get(u_char const **buffer, size_t size) {
+  void *data = malloc(size ? size : 1);
+  if(data == NULL) return NULL;
+
+  memcpy(data, *buffer, size);
+  *buffer += MOOV_INDEX_ALIGN(size);
+
+  return data;
+}
+
+// the arrays of the sample index are used where they are, in a cache entry or
+// a sidecar that outlives the request. Sample cursors never write to them.
+static void *moov_index_at(u_char const **buffer, size_t size) {
+  void *data = (void *)*buffer;
+  *buffer += MOOV_INDEX_ALIGN(size);
+
+  return data;
+}
+
+static u_char *moov_index_write(moov_t const *moov, u_char *buffer) {
+  moov_index_t *index = (moov_index_t *)buffer;
+  unsigned int i;
+
+  index->tracks_ = moov->tracks_;
+  index->timescale_ = moov->mvhd_->timescale_;
+  index->duration_ = moov->mvhd_->duration_;
+  index->segments_length_ = moov->segments_ ? moov->segments_length_ : 0;
+  index->segments_size_ = moov->segments_ ? moov->segments_size_ : 0;
+  buffer += sizeof(moov_index_t);
+
+  if(moov->segments_)
+    buffer = moov_index_put(buffer, moov->segments_, moov->segments_size_ * sizeof(segment_t));
+
+  for(i = 0; i != moov->tracks_; ++i) {
+    trak_t const *trak = moov->traks_[i];
+    sample_entry_t const *sample_entry = &trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0];
+    trak_index_t *trak_index = (trak_index_t *)buffer;
+    size_t samples_size = (size_t)trak->samples_size_ * sizeof(uint32_t);
+
+    trak_index->track_id_ = trak->tkhd_->track_id_;
+    trak_index->handler_type_ = trak->mdia_->hdlr_->handler_type_;
+    trak_index->timescale_ = trak->mdia_->mdhd_->timescale_;
+    trak_index->fourcc_ = sample_entry->fourcc_;
+    trak_index->duration_ = trak->mdia_->mdhd_->duration_;
+    trak_index->entry_len_ = sample_entry->len_;
+    trak_index->samples_size_ = trak->samples_size_;
+    trak_index->chunks_size_ = trak->chunks_size_;
+    trak_index->runs_size_ = trak->runs_size_;
+    trak_index->ctos_ = trak->sample_ctos_ != NULL;
+    trak_index->reserved_ = 0;
+    trak_index->end_pos_ = trak->end_pos_;
+    buffer += sizeof(trak_index_t);
+
+    buffer = moov_index_put(buffer, sample_entry->buf_, sample_entry->len_);
+    buffer = moov_index_put(buffer, trak->sample_sizes_, samples_size);
+    buffer = moov_index_put(buffer, trak->sample_offsets_, samples_size);
+    if(trak->sample_ctos_)
+      buffer = moov_index_put(buffer, trak->sample_ctos_, samples_size + sizeof(uint32_t));
+    buffer = moov_index_put(buffer, trak->sample_sync_, (trak->samples_size_ / 32 + 1) * sizeof(uint32_t));
+    buffer = moov_index_put(buffer, trak->chunks_, trak->chunks_size_ * sizeof(chunks_t));
+    buffer = moov_index_put(buffer, trak->runs_, trak->runs_size_ * sizeof(sample_run_t));
+  }
+
+  return buffer;
+}
+
+// rebuilds just enough of the moov for the outputs.
+static moov_t *moov_index_read(mp4_context_t const *mp4_context, u_char const *buffer, size_t size) {
+  u_char const *end = buffer + size;
+  moov_index_t const *index = (moov_index_t const *)buffer;
+  unsigned int i;
+
+  if(size < sizeof(moov_index_t) || index->tracks_ > MAX_TRACKS) return 0;
+  buffer += sizeof(moov_index_t);
+
+  moov_t *moov = moov_init();
+  moov->mvhd_ = mvhd_init();
+  moov->mvhd_->timescale_ = index->timescale_;
+  moov->mvhd_->duration_ = index->duration_;
+
+  if(index->segments_length_) {
+    size_t segments_size = (size_t)index->segments_size_ * sizeof(segment_t);
+    if((size_t)(end - buffer) < MOOV_INDEX_ALIGN(segments_size)) goto error;
+    moov->segments_ = (segment_t *)moov_index_get(&buffer, segments_size);
+    if(moov->segments_ == NULL) goto error;
+    moov->segments_length_ = index->segments_length_;
+    moov->segments_size_ = index->segments_size_;
+  }
+
+  for(i = 0; i != index->tracks_; ++i) {
+    trak_index_t const *trak_index = (trak_index_t const *)buffer;
+
+    if((size_t)(end - buffer) < sizeof(trak_index_t)) goto error;
+    buffer += sizeof(trak_index_t);
+
+    size_t entry_size = MOOV_INDEX_ALIGN(trak_index->entry_len_);
+    size_t samples_size = (size_t)trak_index->samples_size_ * sizeof(uint32_t);
+    if((size_t)(end - buffer) < entry_size ||
+       (size_t)(end - buffer) - entry_size < trak_index_arrays_size(trak_index->samples_size_, trak_index->chunks_size_,
+                                                                     trak_index->runs_size_, trak_index->ctos_))
+      goto error;
+
+    trak_t *trak = trak_init();
+    moov->traks_[moov->tracks_++] = trak;
+
+    trak->tkhd_ = tkhd_init();
+    trak->tkhd_->track_id_ = trak_index->track_id_;
+
+    trak->mdia_ = mdia_init();
+    trak->mdia_->mdhd_ = mdhd_init();
+    trak->mdia_->mdhd_->timescale_ = trak_index->timescale_;
+    trak->mdia_->mdhd_->duration_ = trak_index->duration_;
+    trak->mdia_->hdlr_ = hdlr_init();
+    trak->mdia_->hdlr_->handler_type_ = trak_index->handler_type_;
+    trak->mdia_->minf_ = minf_init();
+    trak->mdia_->minf_->stbl_ = stbl_init();
+
+    stsd_t *stsd = stsd_init();
+    trak->mdia_->minf_->stbl_->stsd_ = stsd;
+    stsd->sample_entries_ = (sample_entry_t *)malloc(sizeof(sample_entry_t));
+    stsd->entries_ = 1;
+    sample_entry_init(&stsd->sample_entries_[0]);
+    stsd->sample_entries_[0].fourcc_ = trak_index->fourcc_;
+    stsd->sample_entries_[0].len_ = trak_index->entry_len_;
+    stsd->sample_entries_[0].buf_ = (unsigned char *)moov_index_get(&buffer, trak_index->entry_len_);
+
+    trak->samples_size_ = trak_index->samples_size_;
+    trak->chunks_size_ = trak_index->chunks_size_;
+    trak->runs_size_ = trak_index->runs_size_;
+    trak->end_pos_ = trak_index->end_pos_;
+    trak->is_shared_ = 1;
+    trak->sample_sizes_ = (uint32_t *)moov_index_at(&buffer, samples_size);
+    trak->sample_offsets_ = (uint32_t *)moov_index_at(&buffer, samples_size);
+    if(trak_index->ctos_)
+      trak->sample_ctos_ = (uint32_t *)moov_index_at(&buffer, samples_size + sizeof(uint32_t));
+    trak->sample_sync_ = (uint32_t *)moov_index_at(&buffer, (trak->samples_size_ / 32 + 1) * sizeof(uint32_t));
+    trak->chunks_ = (chunks_t *)moov_index_at(&buffer, trak->chunks_size_ * sizeof(chunks_t));
+    trak->runs_ = (sample_run_t *)moov_index_at(&buffer, trak->runs_size_ * sizeof(sample_run_t));
+    trak_build_sync(trak);
+
+    if(!stsd_parse(mp4_context, trak, stsd)) goto error;
+  }
+
+  moov->is_indexed_ = 1;
+
+  return moov;
+
+error:
+  MP4_ERROR("%s", "invalid moov index\n");
+  moov_exit(moov);
+  return 0;
+}
+
+// The sidecar file (<name>.hlsidx) holds a serialized index behind a header
+// that ties it to the size and mtime of the mp4 file it was built from.
+
+#define MOOV_INDEX_MAGIC FOURCC('H', 'L', 'S', 'I')
+#define MOOV_INDEX_VERSION 3
+
+struct moov_index_file_t {
+  uint32_t magic_;
+  uint32_t version_;
+  uint64_t file_size_;
+  int64_t mtime_;
+  uint64_t size_;
+};
+typedef struct moov_index_file_t moov_index_file_t;
+
+static ngx_int_t moov_index_sidecar_path(ngx_http_request_t *r, ngx_str_t *path, ngx_str_t const *name) {
+  path->len = name->len + sizeof(".hlsidx") - 1;
+  path->data = ngx_pnalloc(r->pool, path->len + 1);
+  if(path->data == NULL) return 0;
+
+  ngx_sprintf(path->data, "%V.hlsidx%Z", name);
+
+  return 1;
+}
+
+// maps the sidecar and returns the serialized index in it, or NULL when it is
+// missing or was built from another version of the mp4 file.
+static u_char *moov_index_sidecar_map(mp4_context_t *mp4_context, ngx_str_t const *path,
+                                      ngx_open_file_info_t const *of, size_t *size) {
+  ngx_file_info_t fi;
+  u_char *map = NULL;
+
+  ngx_fd_t fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if(fd == NGX_INVALID_FILE) return NULL;
+
+  if(ngx_fd_info(fd, &fi) != NGX_FILE_ERROR
+     && ngx_file_size(&fi) >= (off_t)sizeof(moov_index_file_t)) {
+    *size = ngx_file_size(&fi);
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) map = NULL;
+  }
+
+  ngx_close_file(fd);
+
+  if(map == NULL) return NULL;
+
+  moov_index_file_t const *header = (moov_index_file_t const *)map;
+  if(header->magic_ == MOOV_INDEX_MAGIC && header->version_ == MOOV_INDEX_VERSION
+     && header->file_size_ == (uint64_t)of->size && header->mtime_ == (int64_t)of->mtime
+     && header->size_ == *size - sizeof(moov_index_file_t))
+    return map;
+
+  MP4_INFO("stale index \"%s\"\n", path->data);
+  munmap(map, *size);
+
+  return NULL;
+}
+
+// directories a sidecar could not be written to, by a hash of their path. A
+// worker tries them again only after MOOV_INDEX_RETRY seconds, so a read-only
+// media directory costs neither a warning nor a serialized index per request.
+#define MOOV_INDEX_DIRS 64
+#define MOOV_INDEX_RETRY 60
+
+struct moov_index_dir_t {
+  uint32_t hash;
+  time_t failed;
+};
+typedef struct moov_index_dir_t moov_index_dir_t;
+
+static moov_index_dir_t moov_index_dirs[MOOV_INDEX_DIRS];
+static ngx_atomic_t moov_index_dirs_lock;  // against the threads of hls_threads
+
+static moov_index_dir_t *moov_index_dir(ngx_str_t const *path, uint32_t *hash) {
+  size_t len = path->len;
+
+  // the directory is everything up to the last slash
+  while(len && path->data[len - 1] != '/') --len;
+  *hash = ngx_crc32_short(path->data, len);
+
+  return &moov_index_dirs[*hash % MOOV_INDEX_DIRS];
+}
+
+static int moov_index_sidecar_writable(ngx_str_t const *path) {
+  uint32_t hash;
+  moov_index_dir_t *dir = moov_index_dir(path, &hash);
+  int writable;
+
+  ngx_spinlock(&moov_index_dirs_lock, 1, 2048);
+  writable = dir->hash != hash || ngx_time() - dir->failed >= MOOV_INDEX_RETRY;
+  ngx_unlock(&moov_index_dirs_lock);
+
+  return writable;
+}
+
+static void moov_index_sidecar_failed(ngx_str_t const *path) {
+  uint32_t hash;
+  moov_index_dir_t *dir = moov_index_dir(path, &hash);
+
+  ngx_spinlock(&moov_index_dirs_lock, 1, 2048);
+  dir->hash = hash;
+  dir->failed = ngx_time();
+  ngx_unlock(&moov_index_dirs_lock);
+}
+
+// writes the sidecar next to the mp4 file. The index is written to a
+// temporary file first, so that other workers never map a partial one.
+static void moov_index_sidecar_write(mp4_context_t *mp4_context, ngx_str_t const *path,
+                                     ngx_open_file_info_t const *of, u_char const *buffer, size_t size) {
+  moov_index_file_t header;
+  u_char temp[NGX_MAX_PATH];
+
+  if(path->len + NGX_INT64_LEN + 2 > NGX_MAX_PATH) return;
+  ngx_sprintf(temp, "%V.%P%Z", path, ngx_pid);
+
+  ngx_fd_t fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+  if(fd == NGX_INVALID_FILE) {
+    MP4_WARNING("can't create index \"%s\"\n", temp);
+    moov_index_sidecar_failed(path);
+    return;
+  }
+
+  header.magic_ = MOOV_INDEX_MAGIC;
+  header.version_ = MOOV_INDEX_VERSION;
+  header.file_size_ = of->size;
+  header.mtime_ = of->mtime;
+  header.size_ = size;
+
+  ngx_int_t written = ngx_write_fd(fd, &header, sizeof(header)) == sizeof(header)
+                      && ngx_write_fd(fd, (void *)buffer, size) == (ssize_t)size;
+
+  ngx_close_file(fd);
+
+  if(!written || ngx_rename_file(temp, path->data) == NGX_FILE_ERROR) {
+    MP4_WARNING("can't write index \"%s\"\n", path->data);
+    moov_index_sidecar_failed(path);
+    ngx_delete_file(temp);
+  }
+}
+
+// opens the mp4 file, or takes its index from the index cache or the sidecar
+static mp4_context_t *mp4_open_index(ngx_http_request_t *r, ngx_file_t *file, ngx_open_file_info_t const *of) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  mp4_context_t *mp4_context;
+  ngx_str_t key, path;
+
+  if(conf->index_cache == NULL && !conf->index_sidecar) return mp4_open(r, file, of, MP4_OPEN_MOOV);
+
+  if(conf->index_cache) {
+    // the segment table in the index is for one hls_length
+    ngx_str_t extra;
+    u_char buf[NGX_INT_T_LEN];
+    extra.data = buf;
+    extra.len = ngx_sprintf(buf, "%ui", conf->length) - buf;
+    if(!hls_cache_key(r, &key, 'i', &file->name, of, &extra)) return 0;
+
+    hls_cache_node_t *node = hls_cache_lookup(r, conf->index_cache, &key);
+    if(node) {
+      mp4_context = mp4_context_init(r, file, of->size);
+      if(!mp4_context) return 0;
+
+      // the entry is held until the request is done, the index is used from it
+      mp4_context->moov = moov_index_read(mp4_context, node->data, node->size);
+      if(mp4_context->moov) return mp4_context;
+
+      mp4_context_exit(mp4_context);
+    }
+  }
+
+  if(conf->index_sidecar) {
+    size_t size;
+
+    if(!moov_index_sidecar_path(r, &path, &file->name)) return 0;
+
+    mp4_context = mp4_context_init(r, file, of->size);
+    if(!mp4_context) return 0;
+
+    u_char *map = moov_index_sidecar_map(mp4_context, &path, of, &size);
+    if(map) {
+      u_char *buffer = map + sizeof(moov_index_file_t);
+      size -= sizeof(moov_index_file_t);
+
+      // the index is used from the mapping, which goes with the context
+      mp4_context->index_map = map;
+      mp4_context->index_map_size = size + sizeof(moov_index_file_t);
+
+      // a sidecar written for another hls_length is used, but not cached
+      // for this one
+      mp4_context->moov = moov_index_read(mp4_context, buffer, size);
+      if(mp4_context->moov && conf->index_cache && mp4_context->moov->segments_length_ == conf->length)
+        hls_cache_insert(conf->index_cache, &key, buffer, size);
+
+      if(mp4_context->moov) return mp4_context;
+    }
+
+    mp4_context_exit(mp4_context);
+  }
+
+  mp4_context = mp4_open(r, file, of, MP4_OPEN_MOOV);
+  if(!mp4_context) return 0;
+
+  // with nowhere to keep it, the index is left to the traks a request uses
+  ngx_flag_t sidecar = conf->index_sidecar && moov_index_sidecar_writable(&path);
+  if(conf->index_cache == NULL && !sidecar) return mp4_context;
+
+  // the serialized index serves requests for any track, so every trak of
+  // it is indexed, not just the ones this request uses
+  if(!moov_build_index(mp4_context, mp4_context->moov) ||
+     !moov_build_segments(mp4_context, mp4_context->moov, conf->length)) {
+    mp4_close(mp4_context);
+    return 0;
+  }
+
+  size_t size = moov_index_size(mp4_context->moov);
+  u_char *buffer = size ? ngx_palloc(r->pool, size) : NULL;
+  if(buffer) {
+    moov_index_write(mp4_context->moov, buffer);
+    if(conf->index_cache) hls_cache_insert(conf->index_cache, &key, buffer, size);
+    if(sidecar) moov_index_sidecar_write(mp4_context, &path, of, buffer, size);
+    ngx_pfree(r->pool, buffer);
+  }
+
+  return mp4_context;
+}
+
+// End Of File
@@ -6,6 +6,9 @@
 
 #define ATOM_PREAMBLE_SIZE 8
 
+// files opened with hls_directio are read in whole blocks of this size
+#define MP4_DIRECTIO_ALIGNMENT 4096
+
 #define FOURCC(a, b, c, d) ((uint32_t)(a) << 24) + \
   ((uint32_t)(b) << 16) + \
   ((uint32_t)(c) << 8) + \
@@ -52,8 +55,21 @@ struct trak_t {
     unsigned int chunks_size_;
     struct chunks_t *chunks_;
 
+    // the sample index, one array per field
     unsigned int samples_size_;
-    struct samples_t *samples_;
+    uint32_t *sample_sizes_;      // size in bytes
+    uint32_t *sample_offsets_;    // byte offset in the chunk
+    uint32_t *sample_ctos_;       // composition time offset, NULL without ctts
+    uint32_t *sample_sync_;       // bitset of sync samples for smooth streaming
+    unsigned int runs_size_;
+    struct sample_run_t *runs_;   // runs of samples with the same duration
+    uint64_t end_pos_;            // byte offset following the last sample
+
+    unsigned int sync_size_;
+    unsigned int *sync_;          // sample number of every sync sample
+
+    int is_indexed_;
+    int is_shared_;               // the index is in a cache entry or sidecar
 };
 typedef struct trak_t trak_t;
 
@@ -262,7 +278,7 @@ struct stts_t {
     unsigned int version_;
     unsigned int flags_;
     uint32_t entries_;
-    struct stts_table_t *table_;
+    unsigned char const *table_;  // big endian stts_table_t entries in the moov
 };
 typedef struct stts_t stts_t;
 
@@ -276,7 +292,7 @@ struct stss_t {
     unsigned int version_;
     unsigned int flags_;
     uint32_t entries_;
-    uint32_t *sample_numbers_;
+    unsigned char const *sample_numbers_; // big endian, in the moov
 };
 typedef struct stss_t stss_t;
 
@@ -300,7 +316,7 @@ struct stsz_t {
     unsigned int flags_;
     uint32_t sample_size_;
     uint32_t entries_;
-    uint32_t *sample_sizes_;
+    unsigned char const *sample_sizes_; // big endian, in the moov
 };
 typedef struct stsz_t stsz_t;
 
@@ -308,7 +324,8 @@ struct stco_t {
     unsigned int version_;
     unsigned int flags_;
     uint32_t entries_;
-    uint64_t *chunk_offsets_;
+    unsigned char const *chunk_offsets_; // big endian, in the moov
+    unsigned int co64_;           // 64 bit offsets
 
     void *stco_inplace_;          // newly generated stco (patched inplace)
 };
@@ -318,7 +335,7 @@ struct ctts_t {
     unsigned int version_;
     unsigned int flags_;
     uint32_t entries_;
-    struct ctts_table_t *table_;
+    unsigned char const *table_;  // big endian ctts_table_t entries in the moov
 };
 typedef struct ctts_t ctts_t;
 
@@ -328,15 +345,45 @@ struct ctts_table_t {
 };
 typedef struct ctts_table_t ctts_table_t;
 
-struct samples_t {
-    uint64_t pts_;                // decoding/presentation time
-    unsigned int size_;           // size in bytes
-    uint64_t pos_;                // byte offset
-    unsigned int cto_;            // composition time offset
-
-    unsigned int is_smooth_ss_: 1; // sync sample for smooth streaming
+struct sample_run_t {
+    unsigned int sample_;         // first sample of the run
+    uint32_t duration_;
+    uint64_t pts_;                // decoding time of the first sample
+};
+typedef struct sample_run_t sample_run_t;
+
+// converts times from one timescale to another like t * to / from, but with
+// a multiply by a fixed point reciprocal of from instead of the division
+struct time_scale_t {
+    uint64_t mult_;               // 2^64 / from, rounded down
+    uint32_t to_;
+    uint32_t from_;
+};
+typedef struct time_scale_t time_scale_t;
+
+// walks the samples of a trak in order, without writing to the index, so
+// the index may be shared with other requests
+struct sample_cursor_t {
+    struct trak_t const *trak_;
+    unsigned int sample_;
+    unsigned int chunk_;
+    unsigned int run_;
+    uint64_t pts_;                // decoding time in the timescale of the trak
+    time_scale_t scale_;          // to the 90kHz clock of MPEG-TS
 };
-typedef struct samples_t samples_t;
+typedef struct sample_cursor_t sample_cursor_t;
+
+struct segment_t {
+    unsigned int start_;          // sync sample the segment is requested by
+    unsigned int end_;            // sync sample the next segment starts with
+    unsigned int first_;          // first sample of the segment
+    unsigned int last_;           // sample following the segment
+    uint64_t pos_;                // byte span of its samples in the first trak
+    uint64_t end_pos_;
+    float duration_;              // duration in seconds
+    uint32_t reserved_;
+};
+typedef struct segment_t segment_t;
 
 struct chunks_t {
     unsigned int sample_;         // number of the first sample in the chunk
@@ -607,6 +654,27 @@ static uint64_t read_64(unsigned char const *buffer) {
   return ((uint64_t)(read_32(buffer)) << 32) + read_32(buffer + 4);
 }
 
+// decodes a run of big endian values, for the tables the index walks
+static void read_32_array(uint32_t *dst, unsigned char const *buffer, unsigned int n) {
+  unsigned int i;
+
+  for(i = 0; i != n; ++i) {
+    dst[i] = read_32(buffer);
+    buffer += 4;
+  }
+}
+
+// dst[i] is the sum of src[0] .. src[i - 1], modulo 2^32
+static void sum_32_array(uint32_t *dst, uint32_t const *src, unsigned int n) {
+  uint32_t sum = 0;
+  unsigned int i;
+
+  for(i = 0; i != n; ++i) {
+    dst[i] = sum;
+    sum += src[i];
+  }
+}
+
 static unsigned char *write_64(unsigned char *buffer, uint64_t v) {
   write_32(buffer + 0, (uint32_t)(v >> 32));
   write_32(buffer + 4, (uint32_t)(v >> 0));
@@ -614,18 +682,59 @@ static unsigned char *write_64(unsigned char *buffer, uint64_t v) {
   return buffer + 8;
 }
 
+// maps the whole file on the first read with hls_mp4_mmap, or falls back to
+// reading it into the buffer. The mapping lives as long as the request:
+// open_file_cache closes its fds without telling us, so a kept mapping could
+// outlive the file it was made for.
+static void mp4_map(mp4_context_t *mp4_context) {
+    mp4_context->map_file = 0;
+    if(mp4_context->filesize <= 0) return;
+
+    u_char *map = mmap(NULL, mp4_context->filesize, PROT_READ, MAP_SHARED, mp4_context->file->fd, 0);
+    if(map == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_WARN, mp4_context->r->connection->log, ngx_errno,
+                      "mmap \"%s\" failed", mp4_context->file->name.data);
+        return;
+    }
+
+    mp4_context->map = map;
+}
+
+// whether size bytes at pos are in the buffer
+static int mp4_buffered(mp4_context_t *mp4_context, off_t pos, size_t size) {
+    off_t start = mp4_context->file->offset - (off_t)mp4_context->buffer_size;
+    return mp4_context->buffer && pos >= start && pos + (off_t)size <= mp4_context->file->offset;
+}
+
+// drops the buffer, the next read fills a new one of size bytes
+static void mp4_buffer_resize(mp4_context_t *mp4_context, size_t size) {
+    if(mp4_context->buffer) ngx_pfree(mp4_context->r->pool, mp4_context->buffer);
+    mp4_context->buffer = 0;
+    mp4_context->buffer_size = size;
+}
+
 static ngx_int_t mp4_read(mp4_context_t *mp4_context, u_char **buffer, size_t size, off_t pos) {
+    if(mp4_context->map_file && mp4_context->map == NULL) mp4_map(mp4_context);
+    if(mp4_context->map) {
+        if(pos < 0 || pos + (off_t)size > mp4_context->filesize) {
+            MP4_ERROR("read of %zu at %"PRIi64" is past the end of \"%s\"", size, (int64_t)pos, mp4_context->file->name.data);
+            return NGX_ERROR;
+        }
+        *buffer = mp4_context->map + pos;
+        mp4_context->offset += size;
+        return NGX_OK;
+    }
+
     if(mp4_context->buffer_size < size) {
-        mp4_context->buffer_size = mp4_context->alignment ? (size / (off_t)4096 + 1) * 4096 : size;
+        mp4_context->buffer_size = mp4_context->alignment ? (size / MP4_DIRECTIO_ALIGNMENT + 1) * MP4_DIRECTIO_ALIGNMENT : size;
         ngx_pfree(mp4_context->r->pool, mp4_context->buffer);
         mp4_context->buffer = 0;
         MP4_INFO("new buffer size: %zu", mp4_context->buffer_size);
     }
 
     if(mp4_context->buffer) {
-        off_t start = mp4_context->file->offset - (off_t)mp4_context->buffer_size;
-        if(pos + (off_t)size <= mp4_context->file->offset && pos > start) {
-            *buffer = mp4_context->buffer + pos - start;
+        if(mp4_buffered(mp4_context, pos, size)) {
+            *buffer = mp4_context->buffer + pos - (mp4_context->file->offset - (off_t)mp4_context->buffer_size);
             mp4_context->offset += size;
             return NGX_OK;
         } else {
@@ -634,31 +743,39 @@ static ngx_int_t mp4_read(mp4_context_t *mp4_context, u_char **buffer, size_t si
         }
     }
 
-    off_t pos_align = mp4_context->alignment ? (pos / (off_t)4096) * 4096 : pos;
-    if(pos != pos_align) mp4_context->buffer_size += 4096;
+    off_t pos_align = mp4_context->alignment ? (pos / MP4_DIRECTIO_ALIGNMENT) * MP4_DIRECTIO_ALIGNMENT : pos;
+    if(pos != pos_align) mp4_context->buffer_size += MP4_DIRECTIO_ALIGNMENT;
 
     if(pos_align + (off_t)mp4_context->buffer_size > mp4_context->filesize) {
         mp4_context->buffer_size = (size_t)(mp4_context->filesize - pos_align);
     }
 
+    // direct I/O needs an aligned buffer and reads whole blocks, the last one
+    // ends short at the end of the file
+    size_t read_size = mp4_context->buffer_size;
+    if(mp4_context->alignment) read_size = ngx_align(read_size, MP4_DIRECTIO_ALIGNMENT);
+
     if(mp4_context->buffer == NULL) {
-        mp4_context->buffer = ngx_palloc(mp4_context->r->pool, mp4_context->buffer_size);
+        if(mp4_context->alignment)
+            mp4_context->buffer = ngx_pmemalign(mp4_context->r->pool, read_size, MP4_DIRECTIO_ALIGNMENT);
+        else
+            mp4_context->buffer = ngx_palloc(mp4_context->r->pool, read_size);
         if (mp4_context->buffer == NULL) {
             return NGX_ERROR;
         }
     }
 
-    ssize_t n = ngx_read_file(mp4_context->file, mp4_context->buffer, mp4_context->buffer_size, pos_align);
+    ssize_t n = ngx_read_file(mp4_context->file, mp4_context->buffer, read_size, pos_align);
 
     if(n == NGX_ERROR) {
         return NGX_ERROR;
     }
 
-    if((size_t) n != mp4_context->buffer_size) {
+    if((size_t) n < mp4_context->buffer_size) {
         MP4_ERROR("read only %zu of %zu from \"%s\"", n, mp4_context->buffer_size, mp4_context->file->name.data);
         return NGX_ERROR;
     }
-    mp4_context->file->offset = pos_align + n;
+    mp4_context->file->offset = pos_align + mp4_context->buffer_size;
     mp4_context->offset += size;
 
     *buffer = mp4_context->buffer + (pos_align == pos ? 0 : pos - pos_align);
@@ -750,7 +867,11 @@ static mp4_context_t *mp4_context_init(ngx_http_request_t *r, ngx_file_t *file,
   mp4_context->moov = 0;
   mp4_context->buffer = 0;
   mp4_context->buffer_size = conf->buffer_size;
-  mp4_context->alignment = 0;
+  mp4_context->alignment = file->directio;
+  // a mapping would go through the page cache that direct I/O keeps clear
+  mp4_context->map_file = conf->mp4_mmap && !file->directio;
+  mp4_context->map = NULL;
+  mp4_context->index_map = NULL;
 
   return mp4_context;
 }
@@ -759,16 +880,125 @@ static void mp4_context_exit(struct mp4_context_t *mp4_context) {
   if(mp4_context->moov_data) ngx_pfree(mp4_context->r->pool, mp4_context->moov_data);
   if(mp4_context->moov) moov_exit(mp4_context->moov);
   if(mp4_context->buffer) ngx_pfree(mp4_context->r->pool, mp4_context->buffer);
+  if(mp4_context->map) munmap(mp4_context->map, mp4_context->filesize);
+  if(mp4_context->index_map) munmap(mp4_context->index_map, mp4_context->index_map_size);
   ngx_pfree(mp4_context->r->pool, mp4_context);
 }
 
-static mp4_context_t *mp4_open(ngx_http_request_t *r, ngx_file_t *file, int64_t filesize, mp4_open_flags flags) {
-  mp4_context_t *mp4_context = mp4_context_init(r, file, filesize);
+// where the top level atoms of recently opened files are, so that opening one
+// again reads just its moov atom. Every worker keeps its own, like the open
+// file cache.
+#define MP4_LAYOUTS 256
+
+// a header that is not in the buffer is read in a block this big
+#define MP4_PROBE_SIZE 4096
+
+struct mp4_layout_t {
+  ngx_file_uniq_t uniq;
+  off_t size;
+  time_t mtime;
+  mp4_atom_t ftyp_atom;
+  mp4_atom_t moov_atom;
+  mp4_atom_t mdat_atom;
+};
+typedef struct mp4_layout_t mp4_layout_t;
+
+static mp4_layout_t mp4_layouts[MP4_LAYOUTS];
+static ngx_atomic_t mp4_layouts_lock;  // against the threads of hls_threads
+
+static mp4_layout_t *mp4_layout(ngx_open_file_info_t const *of) {
+  return &mp4_layouts[((uint64_t)of->uniq ^ (uint64_t)of->size) % MP4_LAYOUTS];
+}
+
+static int mp4_layout_get(mp4_context_t *mp4_context, ngx_open_file_info_t const *of) {
+  mp4_layout_t *layout = mp4_layout(of);
+  int found;
+
+  ngx_spinlock(&mp4_layouts_lock, 1, 2048);
+  found = layout->moov_atom.size_ && layout->uniq == of->uniq
+       && layout->size == of->size && layout->mtime == of->mtime;
+  if(found) {
+    mp4_context->ftyp_atom = layout->ftyp_atom;
+    mp4_context->moov_atom = layout->moov_atom;
+    mp4_context->mdat_atom = layout->mdat_atom;
+  }
+  ngx_unlock(&mp4_layouts_lock);
+
+  return found;
+}
+
+static void mp4_layout_set(mp4_context_t *mp4_context, ngx_open_file_info_t const *of) {
+  mp4_layout_t *layout = mp4_layout(of);
+
+  ngx_spinlock(&mp4_layouts_lock, 1, 2048);
+  layout->uniq = of->uniq;
+  layout->size = of->size;
+  layout->mtime = of->mtime;
+  layout->ftyp_atom = mp4_context->ftyp_atom;
+  layout->moov_atom = mp4_context->moov_atom;
+  layout->mdat_atom = mp4_context->mdat_atom;
+  ngx_unlock(&mp4_layouts_lock);
+}
+
+static int mp4_open_moov(mp4_context_t *mp4_context) {
+  mp4_context->moov_data = read_box(mp4_context, &mp4_context->moov_atom);
+  if(mp4_context->moov_data == NULL) {
+    MP4_ERROR("%s", "No moov data\n");
+    return 0;
+  }
+
+  mp4_context->moov = (moov_t *)
+                      moov_read(mp4_context, NULL,
+                                mp4_context->moov_data + ATOM_PREAMBLE_SIZE,
+                                mp4_context->moov_atom.size_ - ATOM_PREAMBLE_SIZE);
+
+  if(mp4_context->moov == 0 || mp4_context->moov->mvhd_ == 0) {
+    MP4_ERROR("%s", "Error parsing moov header\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+static mp4_context_t *mp4_open(ngx_http_request_t *r, ngx_file_t *file, ngx_open_file_info_t const *of, mp4_open_flags flags) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  mp4_context_t *mp4_context = mp4_context_init(r, file, of->size);
   if(!mp4_context) return 0;
 
+  if(mp4_layout_get(mp4_context, of)) {
+    // one read of just the moov atom, unless the file changed in place
+    mp4_buffer_resize(mp4_context, mp4_context->moov_atom.size_);
+    mp4_context->moov_data = read_box(mp4_context, &mp4_context->moov_atom);
+    if(mp4_context->moov_data && read_32(mp4_context->moov_data + 4) == FOURCC('m', 'o', 'o', 'v')) {
+      if(mp4_open_moov(mp4_context)) return mp4_context;
+      mp4_context_exit(mp4_context);
+      return 0;
+    }
+
+    MP4_WARNING("layout of \"%s\" is stale\n", file->name.data);
+    memset(&mp4_context->ftyp_atom, 0, sizeof(struct mp4_atom_t));
+    memset(&mp4_context->moov_atom, 0, sizeof(struct mp4_atom_t));
+    memset(&mp4_context->mdat_atom, 0, sizeof(struct mp4_atom_t));
+    mp4_context->moov_data = 0;
+    mp4_context->offset = 0;
+    mp4_buffer_resize(mp4_context, conf->buffer_size);
+  }
+
+  // the first read takes the head of the file, with the moov atom of a fast
+  // started file in it
   while(!mp4_context->moov_atom.size_ || !mp4_context->mdat_atom.size_) {
     struct mp4_atom_t leaf_atom;
 
+    if(mp4_context->offset >= mp4_context->filesize) break;
+
+    // a header past the buffer is read with the rest of the file if that
+    // fits in the buffer, which is the moov atom after the mdat atom of a
+    // file that is not fast started. Otherwise just its block is read.
+    if(mp4_context->buffer && !mp4_buffered(mp4_context, mp4_context->offset, ATOM_PREAMBLE_SIZE)) {
+      off_t rest = mp4_context->filesize - mp4_context->offset;
+      mp4_buffer_resize(mp4_context, rest > (off_t)conf->buffer_size ? MP4_PROBE_SIZE : (size_t)rest);
+    }
+
     if(!mp4_atom_read_header(mp4_context, &leaf_atom))
       break;
 
@@ -778,20 +1008,7 @@ static mp4_context_t *mp4_open(ngx_http_request_t *r, ngx_file_t *file, int64_t
       break;
     case FOURCC('m', 'o', 'o', 'v'):
       mp4_context->moov_atom = leaf_atom;
-      mp4_context->moov_data = read_box(mp4_context, &mp4_context->moov_atom);
-      if(mp4_context->moov_data == NULL) {
-        MP4_ERROR("%s", "No moov data\n");
-        mp4_context_exit(mp4_context);
-        return 0;
-      }
-
-      mp4_context->moov = (moov_t *)
-                          moov_read(mp4_context, NULL,
-                                    mp4_context->moov_data + ATOM_PREAMBLE_SIZE,
-                                    mp4_context->moov_atom.size_ - ATOM_PREAMBLE_SIZE);
-
-      if(mp4_context->moov == 0 || mp4_context->moov->mvhd_ == 0) {
-        MP4_ERROR("%s", "Error parsing moov header\n");
+      if(!mp4_open_moov(mp4_context)) {
         mp4_context_exit(mp4_context);
         return 0;
       }
@@ -804,6 +1021,8 @@ static mp4_context_t *mp4_open(ngx_http_request_t *r, ngx_file_t *file, int64_t
     mp4_context->offset = leaf_atom.start_ + leaf_atom.size_;
   }
 
+  if(mp4_context->moov) mp4_layout_set(mp4_context, of);
+
   return mp4_context;
 }
 
@@ -839,6 +1058,10 @@ static moov_t *moov_init() {
 
   moov->is_indexed_ = 0;
 
+  moov->segments_length_ = 0;
+  moov->segments_size_ = 0;
+  moov->segments_ = 0;
+
   return moov;
 }
 
@@ -856,6 +1079,9 @@ static void moov_exit(moov_t *atom) {
   if(atom->mvex_) {
     mvex_exit(atom->mvex_);
   }
+  if(atom->segments_) {
+    free(atom->segments_);
+  }
   free(atom);
 }
 
@@ -868,7 +1094,17 @@ static trak_t *trak_init() {
   trak->chunks_size_ = 0;
   trak->chunks_ = 0;
   trak->samples_size_ = 0;
-  trak->samples_ = 0;
+  trak->sample_sizes_ = 0;
+  trak->sample_offsets_ = 0;
+  trak->sample_ctos_ = 0;
+  trak->sample_sync_ = 0;
+  trak->runs_size_ = 0;
+  trak->runs_ = 0;
+  trak->end_pos_ = 0;
+  trak->sync_size_ = 0;
+  trak->sync_ = 0;
+  trak->is_indexed_ = 0;
+  trak->is_shared_ = 0;
 
 //  trak->fragment_pts_ = 0;
 
@@ -888,11 +1124,16 @@ static void trak_exit(trak_t *trak) {
   if(trak->edts_) {
     edts_exit(trak->edts_);
   }
-  if(trak->chunks_) {
+  if(!trak->is_shared_) {
     free(trak->chunks_);
+    free(trak->sample_sizes_);
+    free(trak->sample_offsets_);
+    free(trak->sample_ctos_);
+    free(trak->sample_sync_);
+    free(trak->runs_);
   }
-  if(trak->samples_) {
-    free(trak->samples_);
+  if(trak->sync_) {
+    free(trak->sync_);
   }
   free(trak);
 }
@@ -1198,9 +1439,6 @@ static struct stbl_t *stbl_init() {
 }
 
 static void ctts_exit(struct ctts_t *atom) {
-  if(atom->table_) {
-    free(atom->table_);
-  }
   free(atom);
 }
 
@@ -1355,12 +1593,18 @@ static stts_t *stts_init() {
 }
 
 static void stts_exit(struct stts_t *atom) {
-  if(atom->table_) {
-    free(atom->table_);
-  }
   free(atom);
 }
 
+// the sample tables are read in place, these decode a single entry
+static uint32_t stts_sample_count(struct stts_t const *stts, unsigned int i) {
+  return read_32(stts->table_ + i * 8 + 0);
+}
+
+static uint32_t stts_sample_duration(struct stts_t const *stts, unsigned int i) {
+  return read_32(stts->table_ + i * 8 + 4);
+}
+
 static unsigned int stts_get_sample(struct stts_t const *stts, uint64_t time) {
   unsigned int stts_index = 0;
   unsigned int stts_count;
@@ -1369,8 +1613,8 @@ static unsigned int stts_get_sample(struct stts_t const *stts, uint64_t time) {
   uint64_t time_count = 0;
 
   for(; stts_index != stts->entries_; ++stts_index) {
-    unsigned int sample_count = stts->table_[stts_index].sample_count_;
-    unsigned int sample_duration = stts->table_[stts_index].sample_duration_;
+    unsigned int sample_count = stts_sample_count(stts, stts_index);
+    unsigned int sample_duration = stts_sample_duration(stts, stts_index);
     if(time_count + (uint64_t)sample_duration * (uint64_t)sample_count >= time) {
       stts_count = (unsigned int)((time - time_count + sample_duration - 1) / sample_duration);
       time_count += (uint64_t)stts_count * (uint64_t)sample_duration;
@@ -1390,8 +1634,8 @@ static uint64_t stts_get_time(struct stts_t const *stts, unsigned int sample) {
   unsigned int sample_count = 0;
 
   for(;;) {
-    unsigned int table_sample_count = stts->table_[stts_index].sample_count_;
-    unsigned int table_sample_duration = stts->table_[stts_index].sample_duration_;
+    unsigned int table_sample_count = stts_sample_count(stts, stts_index);
+    unsigned int table_sample_duration = stts_sample_duration(stts, stts_index);
     if(sample_count + table_sample_count > sample) {
       unsigned int stts_count = (sample - sample_count);
       ret += (uint64_t)stts_count * (uint64_t)table_sample_duration;
@@ -1416,25 +1660,26 @@ static struct stss_t *stss_init() {
 }
 
 static void stss_exit(struct stss_t *atom) {
-  if(atom->sample_numbers_) {
-    free(atom->sample_numbers_);
-  }
   free(atom);
 }
 
+static uint32_t stss_sample_number(struct stss_t const *stss, unsigned int i) {
+  return read_32(stss->sample_numbers_ + i * 4);
+}
+
 static unsigned int stss_get_nearest_keyframe(struct stss_t const *stss, unsigned int sample) {
   // scan the sync samples to find the key frame that precedes the sample number
   unsigned int i;
   unsigned int table_sample = 0;
   for(i = 0; i != stss->entries_; ++i) {
-    table_sample = stss->sample_numbers_[i];
+    table_sample = stss_sample_number(stss, i);
     if(table_sample >= sample)
       break;
   }
   if(table_sample == sample)
     return table_sample;
   else
-    return stss->sample_numbers_[i - 1];
+    return stss_sample_number(stss, i - 1);
 }
 
 static stsc_t *stsc_init() {
@@ -1468,9 +1713,6 @@ static stsz_t *stsz_init() {
 }
 
 static void stsz_exit(struct stsz_t *atom) {
-  if(atom->sample_sizes_) {
-    free(atom->sample_sizes_);
-  }
   free(atom);
 }
 
@@ -1481,17 +1723,19 @@ static stco_t *stco_init() {
   atom->flags_ = 0;
   atom->entries_ = 0;
   atom->chunk_offsets_ = 0;
+  atom->co64_ = 0;
 
   return atom;
 }
 
 static void stco_exit(stco_t *atom) {
-  if(atom->chunk_offsets_) {
-    free(atom->chunk_offsets_);
-  }
   free(atom);
 }
 
+static uint64_t stco_chunk_offset(stco_t const *stco, unsigned int i) {
+  return stco->co64_ ? read_64(stco->chunk_offsets_ + i * 8) : read_32(stco->chunk_offsets_ + i * 4);
+}
+
 static struct ctts_t *ctts_init() {
   struct ctts_t *atom = (struct ctts_t *)malloc(sizeof(struct ctts_t));
   atom->version_ = 0;
@@ -1502,12 +1746,20 @@ static struct ctts_t *ctts_init() {
   return atom;
 }
 
+static uint32_t ctts_sample_count(struct ctts_t const *ctts, unsigned int i) {
+  return read_32(ctts->table_ + i * 8 + 0);
+}
+
+static uint32_t ctts_sample_offset(struct ctts_t const *ctts, unsigned int i) {
+  return read_32(ctts->table_ + i * 8 + 4);
+}
+
 static unsigned int ctts_get_samples(struct ctts_t const *ctts) {
   unsigned int samples = 0;
   unsigned int entries = ctts->entries_;
   unsigned int i;
   for(i = 0; i != entries; ++i) {
-    unsigned int sample_count = ctts->table_[i].sample_count_;
+    unsigned int sample_count = ctts_sample_count(ctts, i);
     samples += sample_count;
   }
 
@@ -1524,6 +1776,31 @@ static uint64_t trak_time_to_moov_time(uint64_t t, uint32_t moov_time_scale,
   return t * (uint64_t)moov_time_scale / trak_time_scale;
 }
 
+static void time_scale_init(time_scale_t *scale, uint32_t to, uint32_t from) {
+  scale->mult_ = from ? UINT64_MAX / from : 0;
+  scale->to_ = to;
+  scale->from_ = from;
+}
+
+static uint64_t time_scale(time_scale_t const *scale, uint64_t t) {
+  uint64_t n = t * (uint64_t)scale->to_;
+
+  if(!scale->from_) return 0;
+
+#if defined(__SIZEOF_INT128__)
+  // the reciprocal is rounded down, so the quotient is at most two short
+  uint64_t q = (uint64_t)(((unsigned __int128)n * scale->mult_) >> 64);
+  uint64_t r = n - q * scale->from_;
+  while(r >= scale->from_) {
+    ++q;
+    r -= scale->from_;
+  }
+  return q;
+#else
+  return n / scale->from_;
+#endif
+}
+
 static mvex_t *mvex_init() {
   mvex_t *mvex = (mvex_t *)malloc(sizeof(mvex_t));
   mvex->unknown_atoms_ = 0;
@@ -123,8 +123,6 @@ static int atom_reader(struct mp4_context_t const *mp4_context,
 static void *ctts_read(mp4_context_t const *UNUSED(mp4_context),
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   ctts_t *atom;
 
   if(size < 8)
@@ -138,15 +136,7 @@ static void *ctts_read(mp4_context_t const *UNUSED(mp4_context),
   if(size < 8 + atom->entries_ * sizeof(ctts_table_t))
     return 0;
 
-  buffer += 8;
-
-  atom->table_ = (ctts_table_t *)(malloc(atom->entries_ * sizeof(ctts_table_t)));
-
-  for(i = 0; i != atom->entries_; ++i) {
-    atom->table_[i].sample_count_ = read_32(buffer + 0);
-    atom->table_[i].sample_offset_ = read_32(buffer + 4);
-    buffer += 8;
-  }
+  atom->table_ = buffer + 8;
 
   return atom;
 }
@@ -154,8 +144,6 @@ static void *ctts_read(mp4_context_t const *UNUSED(mp4_context),
 static void *stco_read(mp4_context_t const *UNUSED(mp4_context),
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   stco_t *atom;
 
   if(size < 8)
@@ -170,11 +158,7 @@ static void *stco_read(mp4_context_t const *UNUSED(mp4_context),
   if(size < 8 + atom->entries_ * sizeof(uint32_t))
     return 0;
 
-  atom->chunk_offsets_ = (uint64_t *)malloc(atom->entries_ * sizeof(uint64_t));
-  for(i = 0; i != atom->entries_; ++i) {
-    atom->chunk_offsets_[i] = read_32(buffer);
-    buffer += 4;
-  }
+  atom->chunk_offsets_ = buffer;
 
   return atom;
 }
@@ -182,8 +166,6 @@ static void *stco_read(mp4_context_t const *UNUSED(mp4_context),
 static void *co64_read(mp4_context_t const *UNUSED(mp4_context),
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   stco_t *atom;
 
   if(size < 8)
@@ -198,11 +180,8 @@ static void *co64_read(mp4_context_t const *UNUSED(mp4_context),
   if(size < 8 + atom->entries_ * sizeof(uint64_t))
     return 0;
 
-  atom->chunk_offsets_ = (uint64_t *)malloc(atom->entries_ * sizeof(uint64_t));
-  for(i = 0; i != atom->entries_; ++i) {
-    atom->chunk_offsets_[i] = read_64(buffer);
-    buffer += 8;
-  }
+  atom->chunk_offsets_ = buffer;
+  atom->co64_ = 1;
 
   return atom;
 }
@@ -210,8 +189,6 @@ static void *co64_read(mp4_context_t const *UNUSED(mp4_context),
 static void *stsz_read(mp4_context_t const *mp4_context,
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   stsz_t *atom;
 
   if(size < 12) {
@@ -237,11 +214,7 @@ static void *stsz_read(mp4_context_t const *mp4_context,
       return 0;
     }
 
-    atom->sample_sizes_ = (uint32_t *)malloc(atom->entries_ * sizeof(uint32_t));
-    for(i = 0; i != atom->entries_; ++i) {
-      atom->sample_sizes_[i] = read_32(buffer);
-      buffer += 4;
-    }
+    atom->sample_sizes_ = buffer;
   }
 
   return atom;
@@ -284,8 +257,6 @@ static void *stsc_read(mp4_context_t const *UNUSED(mp4_context),
 static void *stss_read(mp4_context_t const *UNUSED(mp4_context),
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   stss_t *atom;
 
   if(size < 8)
@@ -299,14 +270,7 @@ static void *stss_read(mp4_context_t const *UNUSED(mp4_context),
   if(size < 8 + atom->entries_ * sizeof(uint32_t))
     return 0;
 
-  buffer += 8;
-
-  atom->sample_numbers_ = (uint32_t *)malloc(atom->entries_ * sizeof(uint32_t));
-
-  for(i = 0; i != atom->entries_; ++i) {
-    atom->sample_numbers_[i] = read_32(buffer);
-    buffer += 4;
-  }
+  atom->sample_numbers_ = buffer + 8;
 
   return atom;
 }
@@ -698,8 +662,6 @@ static int stsd_parse(mp4_context_t const *mp4_context,
 static void *stts_read(mp4_context_t const *UNUSED(mp4_context),
                        void *UNUSED(parent),
                        unsigned char *buffer, uint64_t size) {
-  unsigned int i;
-
   stts_t *atom;
 
   if(size < 8)
@@ -713,15 +675,7 @@ static void *stts_read(mp4_context_t const *UNUSED(mp4_context),
   if(size < 8 + atom->entries_ * sizeof(stts_table_t))
     return 0;
 
-  buffer += 8;
-
-  atom->table_ = (stts_table_t *)(malloc(atom->entries_ * sizeof(stts_table_t)));
-
-  for(i = 0; i != atom->entries_; ++i) {
-    atom->table_[i].sample_count_ = read_32(buffer + 0);
-    atom->table_[i].sample_duration_ = read_32(buffer + 4);
-    buffer += 8;
-  }
+  atom->table_ = buffer + 8;
 
   return atom;
 }
@@ -1591,6 +1545,105 @@ static void *moov_read(mp4_context_t const *mp4_context,
   return atom;
 }
 
+static int trak_is_sync(trak_t const *trak, unsigned int sample) {
+  return (trak->sample_sync_[sample >> 5] >> (sample & 31)) & 1;
+}
+
+static void trak_set_sync(trak_t *trak, unsigned int sample) {
+  trak->sample_sync_[sample >> 5] |= (uint32_t)1 << (sample & 31);
+}
+
+// the last run or chunk that starts at or before sample
+static unsigned int trak_sample_run(trak_t const *trak, unsigned int sample) {
+  unsigned int first = 0, last = trak->runs_size_;
+
+  while(last - first > 1) {
+    unsigned int mid = first + (last - first) / 2;
+    if(trak->runs_[mid].sample_ <= sample) first = mid;
+    else last = mid;
+  }
+
+  return first;
+}
+
+static unsigned int trak_sample_chunk(trak_t const *trak, unsigned int sample) {
+  unsigned int first = 0, last = trak->chunks_size_;
+
+  while(last - first > 1) {
+    unsigned int mid = first + (last - first) / 2;
+    if(trak->chunks_[mid].sample_ <= sample) first = mid;
+    else last = mid;
+  }
+
+  return first;
+}
+
+// decoding time of sample, or the end of the trak for samples_size_
+static uint64_t trak_sample_pts(trak_t const *trak, unsigned int sample) {
+  if(!trak->runs_size_) return 0;
+
+  sample_run_t const *run = &trak->runs_[trak_sample_run(trak, sample)];
+  return run->pts_ + (uint64_t)(sample - run->sample_) * run->duration_;
+}
+
+static uint64_t trak_sample_pos(trak_t const *trak, unsigned int sample) {
+  if(sample == trak->samples_size_) return trak->end_pos_;
+
+  return trak->chunks_[trak_sample_chunk(trak, sample)].pos_ + trak->sample_offsets_[sample];
+}
+
+static void sample_cursor_init(sample_cursor_t *cursor, trak_t const *trak, unsigned int sample) {
+  cursor->trak_ = trak;
+  cursor->sample_ = sample;
+  cursor->chunk_ = trak_sample_chunk(trak, sample);
+  cursor->run_ = trak_sample_run(trak, sample);
+  cursor->pts_ = trak_sample_pts(trak, sample);
+  time_scale_init(&cursor->scale_, 90000, trak->mdia_->mdhd_->timescale_);
+}
+
+static void sample_cursor_next(sample_cursor_t *cursor) {
+  trak_t const *trak = cursor->trak_;
+  unsigned int sample = ++cursor->sample_;
+
+  while(cursor->chunk_ + 1 < trak->chunks_size_ && trak->chunks_[cursor->chunk_ + 1].sample_ <= sample)
+    ++cursor->chunk_;
+
+  if(!trak->runs_size_) return;
+  while(cursor->run_ + 1 < trak->runs_size_ && trak->runs_[cursor->run_ + 1].sample_ <= sample)
+    ++cursor->run_;
+
+  sample_run_t const *run = &trak->runs_[cursor->run_];
+  cursor->pts_ = run->pts_ + (uint64_t)(sample - run->sample_) * run->duration_;
+}
+
+static uint64_t sample_cursor_pos(sample_cursor_t const *cursor) {
+  trak_t const *trak = cursor->trak_;
+
+  if(cursor->sample_ == trak->samples_size_) return trak->end_pos_;
+
+  return trak->chunks_[cursor->chunk_].pos_ + trak->sample_offsets_[cursor->sample_];
+}
+
+static unsigned int sample_cursor_size(sample_cursor_t const *cursor) {
+  return cursor->trak_->sample_sizes_[cursor->sample_];
+}
+
+static unsigned int sample_cursor_cto(sample_cursor_t const *cursor) {
+  trak_t const *trak = cursor->trak_;
+
+  return trak->sample_ctos_ ? trak->sample_ctos_[cursor->sample_] : 0;
+}
+
+// decoding time of the sample in 90kHz
+static uint64_t sample_cursor_dts(sample_cursor_t const *cursor) {
+  return time_scale(&cursor->scale_, cursor->pts_);
+}
+
+// presentation time of the sample in 90kHz
+static uint64_t sample_cursor_pts(sample_cursor_t const *cursor) {
+  return sample_cursor_dts(cursor) + time_scale(&cursor->scale_, sample_cursor_cto(cursor));
+}
+
 static int trak_build_index(mp4_context_t const *mp4_context, trak_t *trak) {
   stco_t const *stco = trak->mdia_->minf_->stbl_->stco_;
   unsigned int stco_samples = 0;
@@ -1603,7 +1656,7 @@ static int trak_build_index(mp4_context_t const *mp4_context, trak_t *trak) {
   {
     unsigned int i;
     for(i = 0; i != trak->chunks_size_; ++i) {
-      trak->chunks_[i].pos_ = stco->chunk_offsets_[i];
+      trak->chunks_[i].pos_ = stco_chunk_offset(stco, i);
     }
   }
 
@@ -1640,37 +1693,54 @@ static int trak_build_index(mp4_context_t const *mp4_context, trak_t *trak) {
     trak->samples_size_ = s;
   }
 
-  // reserve one extra for the end information (like pts and cto).
-  trak->samples_ = (samples_t *)calloc(trak->samples_size_ + 1, sizeof(samples_t));
+  // samples without a position or a time can't be indexed
+  if(stco_samples < trak->samples_size_) {
+    MP4_WARNING("Warning: stco_get_samples=%u, should be %u\n",
+                stco_samples, trak->samples_size_);
+    trak->samples_size_ = stco_samples;
+  }
+
+  stts_t const *stts = trak->mdia_->minf_->stbl_->stts_;
+  unsigned int entries = stts->entries_;
+  unsigned int j;
+  s = 0;
+  for(j = 0; j < entries; j++) s += stts_sample_count(stts, j);
+  if(s < trak->samples_size_) {
+    MP4_WARNING("Warning: stts_get_samples=%u, should be %u\n",
+                s, trak->samples_size_);
+    trak->samples_size_ = s;
+  }
+
+  trak->sample_sizes_ = (uint32_t *)malloc((trak->samples_size_ + 1) * sizeof(uint32_t));
+  trak->sample_offsets_ = (uint32_t *)malloc((trak->samples_size_ + 1) * sizeof(uint32_t));
+  // one bit extra for the end of the trak
+  trak->sample_sync_ = (uint32_t *)calloc(trak->samples_size_ / 32 + 1, sizeof(uint32_t));
 
   if(sample_size == 0) {
-    unsigned int i;
-    for(i = 0; i != trak->samples_size_ ; ++i)
-      trak->samples_[i].size_ = stsz->sample_sizes_[i];
+    read_32_array(trak->sample_sizes_, stsz->sample_sizes_, trak->samples_size_);
   } else {
     unsigned int i;
     for(i = 0; i != trak->samples_size_ ; ++i)
-      trak->samples_[i].size_ = sample_size;
+      trak->sample_sizes_[i] = sample_size;
   }
 
-  // calc pts:
-  stts_t const *stts = trak->mdia_->minf_->stbl_->stts_;
+  // calc pts, one entry for every run of samples with the same duration:
+  trak->runs_ = (sample_run_t *)malloc((entries + 1) * sizeof(sample_run_t));
+  trak->runs_size_ = 0;
   s = 0;
   uint64_t pts = 0;
-  unsigned int entries = stts->entries_;
-  unsigned int j;
-  for(j = 0; j < entries; j++) {
-    unsigned int i;
-    unsigned int sample_count = stts->table_[j].sample_count_;
-    unsigned int sample_duration = stts->table_[j].sample_duration_;
-    for(i = 0; i < sample_count; i++) {
-      trak->samples_[s].pts_ = pts;
-      ++s;
-      pts += sample_duration;
-    }
+  for(j = 0; j < entries && s < trak->samples_size_; j++) {
+    unsigned int sample_count = stts_sample_count(stts, j);
+    unsigned int sample_duration = stts_sample_duration(stts, j);
+    if(!sample_count) continue;
+
+    sample_run_t *run = &trak->runs_[trak->runs_size_++];
+    run->sample_ = s;
+    run->duration_ = sample_duration;
+    run->pts_ = pts;
+    s += sample_count;
+    pts += (uint64_t)sample_count * sample_duration;
   }
-  // write end pts
-  trak->samples_[s].pts_ = pts;
 
   // calc composition times:
   ctts_t const *ctts = trak->mdia_->minf_->stbl_->ctts_;
@@ -1680,134 +1750,244 @@ static int trak_build_index(mp4_context_t const *mp4_context, trak_t *trak) {
     unsigned int j;
     unsigned int sample_offset = 0;
 
+    trak->sample_ctos_ = (uint32_t *)calloc(trak->samples_size_ + 1, sizeof(uint32_t));
     for(j = 0; j != entries; j++) {
       unsigned int i;
-      unsigned int sample_count = ctts->table_[j].sample_count_;
-      sample_offset = ctts->table_[j].sample_offset_;
-      for(i = 0; i < sample_count; i++) {
-        if(s == trak->samples_size_) {
-          MP4_WARNING("Warning: ctts_get_samples=%u, should be %u\n",
-                      ctts_get_samples(ctts), trak->samples_size_);
-          break;
-        }
-
-        trak->samples_[s].cto_ = sample_offset;
-        ++s;
+      unsigned int sample_count = ctts_sample_count(ctts, j);
+      sample_offset = ctts_sample_offset(ctts, j);
+      if(sample_count > trak->samples_size_ - s) {
+        MP4_WARNING("Warning: ctts_get_samples=%u, should be %u\n",
+                    ctts_get_samples(ctts), trak->samples_size_);
+        sample_count = trak->samples_size_ - s;
       }
+
+      for(i = 0; i != sample_count; i++)
+        trak->sample_ctos_[s + i] = sample_offset;
+      s += sample_count;
     }
     // write end cto
-    trak->samples_[s].cto_ = sample_offset;
+    trak->sample_ctos_[s] = sample_offset;
   }
 
-  // calc sample offsets
+  // calc sample offsets in their chunks: a running sum over all samples,
+  // made relative to the first sample of every chunk. The sums wrap, so an
+  // offset that is smaller than the one before it means the chunk is too
+  // large.
+  sum_32_array(trak->sample_offsets_, trak->sample_sizes_, trak->samples_size_);
   s = 0;
-  uint64_t pos = 0;
-  for(j = 0; j < trak->chunks_size_; j++) {
-    pos = trak->chunks_[j].pos_;
-    unsigned int i;
-    for(i = 0; i < trak->chunks_[j].size_; i++) {
-      if(s == trak->samples_size_) {
-        MP4_WARNING("Warning: stco_get_samples=%u, should be %u\n",
-                    stco_samples, trak->samples_size_);
-        break;
-      }
-      trak->samples_[s].pos_ = pos;
-      pos += trak->samples_[s].size_;
-      ++s;
+  for(j = 0; j < trak->chunks_size_ && s < trak->samples_size_; j++) {
+    uint32_t *offsets = trak->sample_offsets_ + s;
+    uint32_t base = offsets[0], last = 0, wrapped = 0;
+    unsigned int i, n = trak->chunks_[j].size_;
+
+    if(n > trak->samples_size_ - s) n = trak->samples_size_ - s;
+    for(i = 0; i != n; ++i) {
+      uint32_t offset = offsets[i] - base;
+      wrapped |= offset < last;
+      last = offset;
+      offsets[i] = offset;
+    }
+    if(wrapped) {
+      MP4_ERROR("%s", "chunk is too large\n");
+      return 0;
     }
+    s += n;
+    trak->end_pos_ = trak->chunks_[j].pos_ + (n ? (uint64_t)last + trak->sample_sizes_[s - 1] : 0);
   }
-  trak->samples_[s].pos_ = pos;
 
   stss_t const *stss = trak->mdia_->minf_->stbl_->stss_;
   if(stss) {
     for(i = 0; i != stss->entries_; ++i) {
-      uint32_t s = stss->sample_numbers_[i] - 1;
-      trak->samples_[s].is_smooth_ss_ = 1;
+      uint32_t s = stss_sample_number(stss, i) - 1;
+      if(s < trak->samples_size_) trak_set_sync(trak, s);
     }
   }
   // write end ss
-  trak->samples_[trak->samples_size_].is_smooth_ss_ = 1;
+  trak_set_sync(trak, trak->samples_size_);
 
   return 1;
 }
 
 static void copy_sync_samples_to_audio_track(trak_t *video, trak_t *audio) {
+  sample_cursor_t audio_cursor;
+  sample_cursor_init(&audio_cursor, audio, 0);
+
   if(video) {
-    samples_t *first = video->samples_;
-    samples_t *last = video->samples_ + video->samples_size_;
-    samples_t *audio_first = audio->samples_;
-    samples_t *audio_last = audio->samples_ + audio->samples_size_;
-    while(first != last) {
-      if(first->is_smooth_ss_) {
-        uint64_t pts = trak_time_to_moov_time(first->pts_,
-                                              audio->mdia_->mdhd_->timescale_, video->mdia_->mdhd_->timescale_);
-        while(audio_first != audio_last) {
-          if(audio_first->pts_ >= pts) {
-            audio_first->is_smooth_ss_ = 1;
+    sample_cursor_t cursor;
+    time_scale_t scale;
+    time_scale_init(&scale, audio->mdia_->mdhd_->timescale_, video->mdia_->mdhd_->timescale_);
+    for(sample_cursor_init(&cursor, video, 0); cursor.sample_ != video->samples_size_; sample_cursor_next(&cursor)) {
+      if(trak_is_sync(video, cursor.sample_)) {
+        uint64_t pts = time_scale(&scale, cursor.pts_);
+        while(audio_cursor.sample_ != audio->samples_size_) {
+          if(audio_cursor.pts_ >= pts) {
+            trak_set_sync(audio, audio_cursor.sample_);
             break;
           }
-          ++audio_first;
+          sample_cursor_next(&audio_cursor);
         }
       }
-      ++first;
     }
   } else {
     // if there is no video track and we don't have sync samples, then insert
     // smooth sync samples every 2 seconds
-    samples_t *f = audio->samples_;
-    samples_t *l = audio->samples_ + audio->samples_size_;
     uint64_t pts = 0;
     uint64_t increment = 2 * audio->mdia_->mdhd_->timescale_;
-    while(f != l) {
-      if(f->pts_ >= pts) {
-        f->is_smooth_ss_ = 1;
+    for(; audio_cursor.sample_ != audio->samples_size_; sample_cursor_next(&audio_cursor)) {
+      if(audio_cursor.pts_ >= pts) {
+        trak_set_sync(audio, audio_cursor.sample_);
         pts += increment;
       }
-      ++f;
     }
   }
 }
 
+static void trak_build_sync(trak_t *trak) {
+  unsigned int i, s = 0;
+
+  for(i = 0; i != trak->samples_size_; ++i) {
+    if(trak_is_sync(trak, i)) ++s;
+  }
+
+  trak->sync_size_ = s;
+  trak->sync_ = (unsigned int *)malloc((s + 1) * sizeof(unsigned int));
+
+  s = 0;
+  for(i = 0; i != trak->samples_size_; ++i) {
+    if(trak_is_sync(trak, i)) trak->sync_[s++] = i;
+  }
+  // the end sample
+  trak->sync_[s] = trak->samples_size_;
+}
+
+// indexes a single trak, so a request only pays for the traks it uses
+static int moov_build_trak_index(struct mp4_context_t const *mp4_context,
+                                 struct moov_t *moov, trak_t *trak) {
+  if(moov->is_indexed_ || trak->is_indexed_) return 1;
+
+  if(!trak_build_index(mp4_context, trak)) return 0;
+
+  // Copy the sync sample markers for smooth streaming from the video trak
+  // to the audio trak in case the audio track doesn't have an 'stss'.
+  if(trak->mdia_->hdlr_->handler_type_ == FOURCC('s', 'o', 'u', 'n') &&
+     !moov->mvex_ && !trak->mdia_->minf_->stbl_->stss_) {
+    trak_t *video_trak = NULL;
+    unsigned int track;
+
+    for(track = 0; track != moov->tracks_; ++track) {
+      if(moov->traks_[track]->mdia_->hdlr_->handler_type_ == FOURCC('v', 'i', 'd', 'e'))
+        video_trak = moov->traks_[track];
+    }
+    if(video_trak && !moov_build_trak_index(mp4_context, moov, video_trak)) return 0;
+
+    copy_sync_samples_to_audio_track(video_trak, trak);
+  }
+
+  trak_build_sync(trak);
+  trak->is_indexed_ = 1;
+
+  return 1;
+}
+
 static int moov_build_index(struct mp4_context_t const *mp4_context,
                             struct moov_t *moov) {
   // Build the track index
-  trak_t *video_trak = NULL;
   unsigned int track;
 
   if(!moov) return 0;
   // already indexed?
   if(moov->is_indexed_) return 1;
 
-  moov->is_indexed_ = 1;
-
   for(track = 0; track != moov->tracks_; ++track) {
-    trak_t *trak = moov->traks_[track];
-    switch(trak->mdia_->hdlr_->handler_type_) {
-    case FOURCC('s', 'o', 'u', 'n'):
-      break;
-    case FOURCC('v', 'i', 'd', 'e'):
-      video_trak = trak;
-      break;
-    }
-    if(!trak_build_index(mp4_context, trak)) return 0;
+    if(!moov_build_trak_index(mp4_context, moov, moov->traks_[track])) return 0;
   }
 
-  for(track = 0; track != moov->tracks_; ++track) {
-    trak_t *trak = moov->traks_[track];
-    switch(trak->mdia_->hdlr_->handler_type_) {
-    case FOURCC('s', 'o', 'u', 'n'):
-      // Copy the sync sample markers for smooth streaming from the video trak
-      // to the audio trak in case the audio track doesn't have an 'stss'.
-      if(!moov->mvex_ && !trak->mdia_->minf_->stbl_->stss_) {
-        copy_sync_samples_to_audio_track(video_trak, trak);
-      }
-      break;
-    }
+  moov->is_indexed_ = 1;
+
+  return 1;
+}
+
+static float trak_segment_duration(trak_t const *trak, uint64_t first, uint64_t last) {
+  float duration = (float)((last - first) / (float)trak->mdia_->mdhd_->timescale_) + 0.0005;
+  return duration;
+}
+
+// returns the first sync sample from sync number s on that is at least
+// seconds after pts, or sync_size_ for the end of the track.
+static unsigned int trak_segment_end(trak_t const *trak, uint64_t pts, unsigned int s, u_int seconds) {
+  unsigned int last = trak->sync_size_;
+
+  while(s < last) {
+    unsigned int mid = s + (last - s) / 2;
+    if(trak_segment_duration(trak, pts, trak_sample_pts(trak, trak->sync_[mid])) >= seconds) last = mid;
+    else s = mid + 1;
   }
 
+  return s;
+}
+
+// splits the first track into segments of length seconds. The segments are
+// kept with the moov until it is indexed for another length, and with the
+// serialized index. The other traks have their sync samples where the first
+// one has, so a segment is the same run of sync samples in all of them.
+static int moov_build_segments(struct mp4_context_t const *mp4_context,
+                               struct moov_t *moov, u_int length) {
+  if(moov->segments_ && moov->segments_length_ == length) return 1;
+  if(!moov->tracks_) return 0;
+
+  trak_t const *trak = moov->traks_[0];
+  if(!moov_build_trak_index(mp4_context, moov, moov->traks_[0])) return 0;
+
+  if(moov->segments_) free(moov->segments_);
+  moov->segments_ = (segment_t *)malloc((trak->sync_size_ + 1) * sizeof(segment_t));
+  if(moov->segments_ == NULL) return 0;
+  moov->segments_length_ = length;
+  moov->segments_size_ = 0;
+
+  if(!trak->samples_size_) return 1;
+
+  // the first segment starts with the first sample, even if it isn't a sync
+  // sample. It ends after the first sync sample at the earliest, so that no
+  // two segments are requested by the same sync sample.
+  unsigned int start = 0, first = 0;
+  unsigned int s = trak->sync_size_ ? 1 : 0;
+  while(1) {
+    uint64_t pts = trak_sample_pts(trak, first);
+    s = trak_segment_end(trak, pts, s, length);
+
+    segment_t *segment = &moov->segments_[moov->segments_size_++];
+    segment->start_ = start;
+    segment->end_ = s;
+    segment->first_ = first;
+    segment->last_ = trak->sync_[s];
+    segment->pos_ = trak_sample_pos(trak, segment->first_);
+    segment->end_pos_ = trak_sample_pos(trak, segment->last_);
+    segment->duration_ = trak_segment_duration(trak, pts, trak_sample_pts(trak, segment->last_));
+    segment->reserved_ = 0;
+
+    if(s == trak->sync_size_) break;
+    start = s;
+    first = trak->sync_[s];
+    ++s;
+  }
 
   return 1;
 }
 
+// the segment that sync sample start begins, as the playlist links it
+static segment_t const *moov_segment(moov_t const *moov, uint64_t start) {
+  unsigned int first = 0, last = moov->segments_size_;
+
+  while(first < last) {
+    unsigned int mid = first + (last - first) / 2;
+    if(moov->segments_[mid].start_ < start) first = mid + 1;
+    else last = mid;
+  }
+
+  if(first == moov->segments_size_ || moov->segments_[first].start_ != start) return NULL;
+
+  return &moov->segments_[first];
+}
+
 // End Of File
 
@@ -8,12 +8,42 @@
 #include "mp4_io.h"
 #include "mp4_reader.h"
 #include "moov.h"
+#include "hls_cache.h"
+#include "moov_index.h"
 #include "output_bucket.h"
+#include "hls_uring.h"
 #include "view_count.h"
 #include "output_m3u8.h"
 #include "output_ts.h"
 #include "mod_streaming_export.h"
 
+static void *ngx_http_hls_create_main_conf(ngx_conf_t *cf) {
+    hls_main_conf_t *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(hls_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&conf->caches, cf->pool, 4, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    conf->output_slabs = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+static char *ngx_http_hls_init_main_conf(ngx_conf_t *cf, void *conf) {
+    hls_main_conf_t *hmcf = conf;
+
+    ngx_conf_init_uint_value(hmcf->output_slabs, 0);
+
+    return NGX_CONF_OK;
+}
+
 static void *ngx_http_hls_create_conf(ngx_conf_t *cf) {
     hls_conf_t *conf;
 
@@ -34,6 +64,21 @@ static void *ngx_http_hls_create_conf(ngx_conf_t *cf) {
     conf->relative = NGX_CONF_UNSET;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->mp4_mmap = NGX_CONF_UNSET;
+    conf->directio = NGX_CONF_UNSET;
+    conf->prefetch = NGX_CONF_UNSET;
+    conf->read_window = NGX_CONF_UNSET_SIZE;
+    conf->index_cache = NGX_CONF_UNSET_PTR;
+    conf->index_sidecar = NGX_CONF_UNSET;
+    conf->playlist_cache = NGX_CONF_UNSET_PTR;
+    conf->segment_cache = NGX_CONF_UNSET_PTR;
+    conf->segment_cache_lock = NGX_CONF_UNSET;
+    conf->segment_cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->ts_buffer_size = NGX_CONF_UNSET_SIZE;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    conf->io_uring = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -47,6 +92,23 @@ static char *ngx_http_hls_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, 512 * 1024);
     ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
                               10 * 1024 * 1024);
+    ngx_conf_merge_value(conf->mp4_mmap, prev->mp4_mmap, 0);
+    ngx_conf_merge_off_value(conf->directio, prev->directio,
+                             NGX_OPEN_FILE_DIRECTIO_OFF);
+    ngx_conf_merge_value(conf->prefetch, prev->prefetch, 0);
+    ngx_conf_merge_size_value(conf->read_window, prev->read_window, 0);
+    ngx_conf_merge_ptr_value(conf->index_cache, prev->index_cache, NULL);
+    ngx_conf_merge_value(conf->index_sidecar, prev->index_sidecar, 0);
+    ngx_conf_merge_ptr_value(conf->playlist_cache, prev->playlist_cache, NULL);
+    ngx_conf_merge_ptr_value(conf->segment_cache, prev->segment_cache, NULL);
+    ngx_conf_merge_value(conf->segment_cache_lock, prev->segment_cache_lock, 0);
+    ngx_conf_merge_msec_value(conf->segment_cache_lock_timeout,
+                              prev->segment_cache_lock_timeout, 5000);
+    ngx_conf_merge_size_value(conf->ts_buffer_size, prev->ts_buffer_size, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
 
     if(conf->length < 1) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -65,6 +127,7 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
   ngx_str_t                   path;
   ngx_open_file_info_t        of;
   ngx_http_core_loc_conf_t    *clcf;
+  hls_conf_t                  *conf;
 
   if(!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
     return NGX_HTTP_NOT_ALLOWED;
@@ -96,7 +159,6 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
   u_int m3u8 = 0;
 
   struct bucket_t *bucket = bucket_init(r);
-  int result = 0;
   {
     if(ngx_strstr(path.data, "m3u8")) m3u8 = 1;
     char *ext = strrchr((const char *)path.data, '.');
@@ -109,11 +171,12 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0, "http mp4 filename: \"%s\"", path.data);
 
   clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
 
   ngx_memzero(&of, sizeof(ngx_open_file_info_t));
 
   of.read_ahead = clcf->read_ahead;
-  of.directio = NGX_MAX_OFF_T_VALUE;
+  of.directio = conf->directio;
   of.valid = clcf->open_file_cache_valid;
   of.min_uses = clcf->open_file_cache_min_uses;
   of.errors = clcf->open_file_cache_errors;
@@ -165,20 +228,438 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
   file->fd = of.fd;
   file->name = path;
   file->log = nlog;
+  file->directio = of.is_directio;
+
+  hls_ctx_t *ctx = ngx_pcalloc(r->pool, sizeof(hls_ctx_t));
+  if(ctx == NULL) {
+    mp4_split_options_exit(r, options);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ctx->options = options;
+  ctx->file = file;
+  ctx->of = of;
+  ctx->root = root;
+  ctx->m3u8 = m3u8;
+  ctx->bucket = bucket;
+
+  ngx_http_set_ctx(r, ctx, ngx_http_streaming_module);
+
+  return ngx_streaming_output(r, ctx);
+}
+
+static void ngx_streaming_wait_cleanup(void *data) {
+  hls_ctx_t *ctx = data;
+
+  if(ctx->wait.timer_set) ngx_del_timer(&ctx->wait);
+}
+
+static void ngx_streaming_wait_handler(ngx_event_t *ev) {
+  ngx_http_request_t *r = ev->data;
+  ngx_connection_t *c = r->connection;
+  hls_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_streaming_module);
+
+  ngx_http_finalize_request(r, ngx_streaming_output(r, ctx));
+  ngx_http_run_posted_requests(c);
+}
+
+// polls until the segment another request is building is in the cache
+static ngx_int_t ngx_streaming_wait(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  if(ctx->wait.handler == NULL) {
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln == NULL) return NGX_ERROR;
+    cln->handler = ngx_streaming_wait_cleanup;
+    cln->data = ctx;
+
+    ctx->wait.handler = ngx_streaming_wait_handler;
+    ctx->wait.data = r;
+    ctx->wait.log = r->connection->log;
+    ctx->wait_start = ngx_current_msec;
+  }
+
+  ngx_add_timer(&ctx->wait, 100);
+  r->main->count++;
+
+  return NGX_DONE;
+}
+
+// opens the mp4 file and creates the playlist or segment in the bucket. It
+// runs in a thread with hls_threads, so it must not touch the connection.
+static void ngx_streaming_build(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  mp4_context_t *mp4_context = mp4_open_index(r, ctx->file, &ctx->of);
+
+  ctx->mp4_context = mp4_context;
+  ctx->built = 1;
+  if(!mp4_context) return;
+
+  mp4_context->root = ctx->root;
+  if(ctx->m3u8) {
+    if((ctx->result = mp4_create_m3u8(mp4_context, ctx->bucket)) && ctx->key.data)
+      m3u8_cache_write(r, &ctx->key, ctx->bucket, ctx->result);
+  } else {
+    ngx_int_t rc = NGX_OK;
+    if((ctx->result = output_ts(mp4_context, ctx->bucket, ctx->options)) && ctx->key.data)
+      rc = ts_cache_write(r, &ctx->key, ctx->bucket);
+    // the requests waiting for the segment go on while this one is sent
+    hls_cache_unlock(ctx->lock, ctx->result && rc == NGX_DECLINED);
+  }
+}
+
+static void ngx_streaming_close(void *data) {
+  hls_ctx_t *ctx = data;
+
+  output_ts_close(ctx->mp4_context, ctx->muxer);
+  mp4_close(ctx->mp4_context);
+}
+
+// opens the mp4 file and the muxer of a segment that is muxed after its
+// headers are sent. They are closed with the request.
+static void ngx_streaming_open(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  mp4_context_t *mp4_context = mp4_open_index(r, ctx->file, &ctx->of);
+
+  ctx->mp4_context = mp4_context;
+  ctx->built = 1;
+  if(!mp4_context) return;
+
+  mp4_context->root = ctx->root;
+  ctx->muxer = output_ts_open(mp4_context, ctx->bucket, ctx->options);
+  if(ctx->muxer == NULL) return;
+
+  ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+  if(cln == NULL) {
+    output_ts_close(mp4_context, ctx->muxer);
+    ctx->muxer = NULL;
+    return;
+  }
+  cln->handler = ngx_streaming_close;
+  cln->data = ctx;
+
+  ctx->result = 1;
+}
+
+// passes the segment on hls_ts_buffer_size bytes at a time, or all of it
+// without hls_ts_buffer_size. The next part is muxed only once the previous
+// one is written, so a slow client holds back the muxer instead of the whole
+// segment piling up in memory.
+static ngx_int_t ngx_streaming_send(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  ngx_http_core_loc_conf_t *clcf;
+  ngx_event_t *wev = r->connection->write;
+  bucket_t *bucket = ctx->bucket;
+  ngx_chain_t *cl;
+  uint64_t size;
+  ngx_int_t rc;
+
+  for(;;) {
+    rc = ngx_http_output_filter(r, ctx->out);
+    ctx->out = NULL;
+    if(rc == NGX_ERROR) return rc;
+
+    if(rc == NGX_AGAIN) {
+      clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+      if(!wev->delayed) ngx_add_timer(wev, clcf->send_timeout);
+      if(ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) return NGX_ERROR;
+      return NGX_AGAIN;
+    }
+
+    bucket_reset(bucket);
+    if(ctx->muxed) return rc;
+
+    size = conf->ts_buffer_size ? conf->ts_buffer_size : (uint64_t)-1;
+    if(ctx->range_end && size > ctx->range_end - bucket->content_length)
+      size = ctx->range_end - bucket->content_length;
+
+    ctx->muxed = output_ts_mux(ctx->muxer, size);
+    if(ctx->muxed == NGX_ERROR) return NGX_ERROR;
+    ctx->out = bucket->first;
+    if(ctx->range_end) {
+      if(bucket->content_length >= (uint64_t)ctx->range_end) ctx->muxed = 1;
+      ctx->out = bucket_range(bucket, ctx->range_start, ctx->range_end);
+    }
+    if(ctx->out == NULL) return ngx_http_send_special(r, NGX_HTTP_LAST);
+
+    // every part is flushed, so its buffers are free once the filter is done
+    for(cl = ctx->out; cl->next; cl = cl->next) { /* void */ }
+    cl->buf->flush = 1;
+    if(!ctx->muxed) {
+      cl->buf->last_buf = 0;
+      cl->buf->last_in_chain = 0;
+    }
+  }
+}
+
+// answers a single range of a segment that is muxed after its headers are
+// sent with only the samples it needs. Other ranges and conditional requests
+// are left to the range filter, which cuts them from the whole segment.
+static ngx_int_t ngx_streaming_range(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  ngx_table_elt_t *range = r->headers_in.range;
+  off_t size = r->headers_out.content_length_n, start = 0, end = 0;
+  off_t cutoff = NGX_MAX_OFF_T_VALUE / 10;
+  ngx_flag_t suffix = 0;
+  u_char *p, *last;
+
+  if(range == NULL || r != r->main || r->http_version < NGX_HTTP_VERSION_10 || range->value.len < 7
+     || ngx_strncasecmp(range->value.data, (u_char *)"bytes=", 6) != 0)
+    return NGX_DECLINED;
+
+  if(r->headers_in.if_range || r->headers_in.if_modified_since || r->headers_in.if_unmodified_since
+     || r->headers_in.if_match || r->headers_in.if_none_match)
+    return NGX_DECLINED;
+
+  p = range->value.data + 6;
+  last = range->value.data + range->value.len;
+
+  while(p < last && *p == ' ') p++;
+  if(p < last && *p == '-') {
+    suffix = 1;
+    p++;
+  } else {
+    if(p == last || *p < '0' || *p > '9') return NGX_DECLINED;
+    while(p < last && *p >= '0' && *p <= '9') {
+      if(start >= cutoff) return NGX_DECLINED;
+      start = start * 10 + (*p++ - '0');
+    }
+    while(p < last && *p == ' ') p++;
+    if(p == last || *p++ != '-') return NGX_DECLINED;
+  }
+
+  while(p < last && *p == ' ') p++;
+  if(p == last) {
+    if(suffix) return NGX_DECLINED;
+    end = size;
+  } else {
+    if(*p < '0' || *p > '9') return NGX_DECLINED;
+    while(p < last && *p >= '0' && *p <= '9') {
+      if(end >= cutoff) return NGX_DECLINED;
+      end = end * 10 + (*p++ - '0');
+    }
+    while(p < last && *p == ' ') p++;
+    // more than one range
+    if(p != last) return NGX_DECLINED;
+
+    if(suffix) {
+      if(end == 0) return NGX_DECLINED;
+      start = end < size ? size - end : 0;
+      end = size;
+    } else if(end < size) {
+      end++;
+    } else end = size;
+  }
+
+  // unsatisfiable ranges get their 416 from the range filter
+  if(start >= end) return NGX_DECLINED;
+
+  ngx_table_elt_t *h = ngx_list_push(&r->headers_out.headers);
+  if(h == NULL) return NGX_ERROR;
+
+  h->value.data = ngx_pnalloc(r->pool, sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+  if(h->value.data == NULL) return NGX_ERROR;
+
+  h->hash = 1;
+  h->key.len = sizeof("Content-Range") - 1;
+  h->key.data = (u_char *)"Content-Range";
+  h->value.len = ngx_sprintf(h->value.data, "bytes %O-%O/%O", start, end - 1, size) - h->value.data;
+  r->headers_out.content_range = h;
+
+  r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+  r->headers_out.content_length_n = end - start;
+  ctx->range_start = start;
+  ctx->range_end = end;
+
+  return NGX_OK;
+}
+
+static void ngx_streaming_send_handler(ngx_http_request_t *r) {
+  hls_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_streaming_module);
+  ngx_event_t *wev = r->connection->write;
+  ngx_int_t rc;
+
+  if(wev->timedout) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT, "client timed out");
+    r->connection->timedout = 1;
+    ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+    return;
+  }
+
+  rc = ngx_streaming_send(r, ctx);
+  if(rc == NGX_AGAIN) return;
 
-  mp4_context_t *mp4_context = mp4_open(r, file, of.size, MP4_OPEN_MOOV);
+  r->write_event_handler = ngx_http_request_empty_handler;
+  ngx_http_finalize_request(r, rc);
+}
+
+// sends a segment whose samples are read
+static ngx_int_t ngx_streaming_start(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  ngx_int_t rc;
+
+  // any other range is cut from the stream as it passes
+  r->single_range = 1;
+  rc = ngx_streaming_send(r, ctx);
+  if(rc != NGX_AGAIN) return rc;
+
+  r->main->count++;
+  r->write_event_handler = ngx_streaming_send_handler;
+  return NGX_DONE;
+}
+
+#if (NGX_HLS_IO_URING)
+static void ngx_streaming_uring_handler(hls_uring_io_t *io) {
+  ngx_http_request_t *r = io->data;
+  ngx_connection_t *c = r->connection;
+  hls_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_streaming_module);
+
+  ngx_http_set_log_request(c->log, r);
+
+  r->main->blocked--;
+  r->aio = 0;
+
+  if(!output_ts_read_done(ctx->muxer, io)) ngx_http_finalize_request(r, NGX_ERROR);
+  else ngx_http_finalize_request(r, ngx_streaming_start(r, ctx));
+  ngx_http_run_posted_requests(c);
+}
+
+// reads the samples of a segment in one io_uring submission, the event loop
+// goes on until they are read
+static ngx_int_t ngx_streaming_uring(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  ngx_uint_t i;
+  ngx_int_t rc;
+
+  hls_uring_io_t *io = output_ts_read_io(ctx->muxer, &rc);
+  if(io == NULL) return rc == NGX_OK ? ngx_streaming_start(r, ctx) : NGX_ERROR;
+
+  io->handler = ngx_streaming_uring_handler;
+  io->data = r;
+
+  rc = hls_uring_submit(io);
+  if(rc == NGX_AGAIN) {
+    r->main->blocked++;
+    r->aio = 1;
+    r->main->count++;
+    return NGX_DONE;
+  }
+
+  // without a ring the reads are done here
+  for(i = 0; i < io->nreads; ++i) {
+    io->reads[i].bytes = ngx_read_file(ctx->file, io->reads[i].buf, io->reads[i].size, io->reads[i].pos);
+  }
+  if(!output_ts_read_done(ctx->muxer, io)) return NGX_ERROR;
+
+  return ngx_streaming_start(r, ctx);
+}
+#endif
+
+#if (NGX_THREADS)
+static void ngx_streaming_thread_handler(void *data, ngx_log_t *log) {
+  ngx_http_request_t *r = data;
+  hls_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_streaming_module);
+
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "hls thread build");
+
+  ngx_streaming_build(r, ctx);
+}
+
+static void ngx_streaming_thread_event_handler(ngx_event_t *ev) {
+  ngx_http_request_t *r = ev->data;
+  ngx_connection_t *c = r->connection;
+  hls_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_streaming_module);
+
+  ngx_http_set_log_request(c->log, r);
+
+  r->main->blocked--;
+  r->aio = 0;
+
+  ngx_http_finalize_request(r, ngx_streaming_output(r, ctx));
+  ngx_http_run_posted_requests(c);
+}
+
+// builds in the thread pool, the event loop continues once it is done
+static ngx_int_t ngx_streaming_thread(ngx_http_request_t *r, ngx_thread_pool_t *pool) {
+  ngx_thread_task_t *task = ngx_thread_task_alloc(r->pool, 0);
+  if(task == NULL) return NGX_ERROR;
+
+  task->ctx = r;
+  task->handler = ngx_streaming_thread_handler;
+  task->event.data = r;
+  task->event.handler = ngx_streaming_thread_event_handler;
+
+  if(ngx_thread_task_post(pool, task) != NGX_OK) return NGX_ERROR;
+
+  r->main->blocked++;
+  r->aio = 1;
+  r->main->count++;
+
+  return NGX_DONE;
+}
+#endif
+
+static ngx_int_t ngx_streaming_output(ngx_http_request_t *r, hls_ctx_t *ctx) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  mp4_split_options_t *options = ctx->options;
+  ngx_file_t *file = ctx->file;
+  ngx_str_t *path = &file->name;
+  struct bucket_t *bucket = ctx->bucket;
+  ngx_log_t *nlog = r->connection->log;
+  ngx_int_t rc;
+  int result = ctx->result;
+
+  if(!ctx->built) {
+    // cached playlists and segments need nothing from the mp4 file
+    ngx_str_t *key = &ctx->key;
+    if(ctx->m3u8) result = m3u8_cache_read(r, key, file, &ctx->of, ctx->root, bucket);
+    else result = ts_cache_read(r, key, file, &ctx->of, options, bucket);
+
+    // concurrent requests for a segment wait for the first one to build it.
+    // HEAD requests don't build it.
+    if(!result && !ctx->m3u8 && key->data && conf->segment_cache_lock && r->method != NGX_HTTP_HEAD
+       && (ctx->wait.handler == NULL || ngx_current_msec - ctx->wait_start < conf->segment_cache_lock_timeout)) {
+      rc = hls_cache_lock(r, conf->segment_cache, key, &ctx->lock);
+      if(rc == NGX_AGAIN) {
+        rc = ngx_streaming_wait(r, ctx);
+        if(rc == NGX_DONE) return rc;
+      } else if(rc == NGX_DECLINED) {
+        result = ts_cache_read(r, key, file, &ctx->of, options, bucket);
+      }
+    }
+
+    if(result) {
+      ctx->result = result;
+      ctx->mp4_context = mp4_context_init(r, file, ctx->of.size);
+      ctx->built = 1;
+    } else {
+      ngx_flag_t threaded = 0;
+#if (NGX_THREADS)
+      threaded = conf->thread_pool != NULL;
+#endif
+      // a segment that is not cached is muxed after its headers are sent, so
+      // HEAD and not modified responses read no samples
+      if(!ctx->m3u8 && (r->method == NGX_HTTP_HEAD || (!key->data && !threaded))) {
+        ngx_streaming_open(r, ctx);
+      }
+#if (NGX_THREADS)
+      else if(threaded) {
+        rc = ngx_streaming_thread(r, conf->thread_pool);
+        if(rc == NGX_DONE) return rc;
+        mp4_split_options_exit(r, options);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+#endif
+      else ngx_streaming_build(r, ctx);
+      result = ctx->result;
+    }
+  }
+
+  mp4_context_t *mp4_context = ctx->mp4_context;
   if(!mp4_context) {
     mp4_split_options_exit(r, options);
     ngx_log_error(NGX_LOG_ALERT, nlog, ngx_errno, "mp4_open failed");
     return NGX_HTTP_INTERNAL_SERVER_ERROR;
   }
 
-  mp4_context->root = root;
-  if(m3u8) {
-    if((result = mp4_create_m3u8(mp4_context, bucket))) {
+  mp4_context->root = ctx->root;
+  if(ctx->m3u8) {
+    if(result) {
       char action[50];
       sprintf(action, "ios_playlist&segments=%d", result);
-      view_count(mp4_context, (char *)path.data, options ? options->hash : NULL, action);
+      view_count(mp4_context, (char *)path->data, options ? options->hash : NULL, action);
     }
     r->allow_ranges = 0;
     // dirty hack
@@ -186,18 +667,18 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
     r->headers_out.content_type.len = 29;
     r->headers_out.content_type_len = r->headers_out.content_type.len;
   } else {
-    result = output_ts(mp4_context, bucket, options);
     if(!options || !result) {
       mp4_close(mp4_context);
       ngx_log_error(NGX_LOG_ALERT, nlog, ngx_errno, "output_ts failed");
       return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
     char action[50] = "ios_view";
-    view_count(mp4_context, (char *)path.data, options->hash, action);
+    view_count(mp4_context, (char *)path->data, options->hash, action);
     r->allow_ranges = 1;
   }
 
-  mp4_close(mp4_context);
+  // the muxer of a segment that is sent while it is muxed still needs it
+  if(!ctx->muxer) mp4_close(mp4_context);
   mp4_split_options_exit(r, options);
 
   result = result == 0 ? 415 : 200;
@@ -207,10 +688,12 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
   if(result && bucket) {
     nlog->action = "sending mp4 to client";
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0, "content_length: %d", bucket->content_length);
     r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = bucket->content_length;
-    r->headers_out.last_modified_time = of.mtime;
+    r->headers_out.content_length_n = ctx->muxer ? output_ts_size(ctx->muxer) : bucket->content_length;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, nlog, 0, "content_length: %O", r->headers_out.content_length_n);
+    r->headers_out.last_modified_time = ctx->of.mtime;
+
+    if(ctx->muxer && ngx_streaming_range(r, ctx) == NGX_ERROR) return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
     if(ngx_http_set_content_type(r) != NGX_OK) return NGX_HTTP_INTERNAL_SERVER_ERROR;
 
@@ -226,15 +709,127 @@ static ngx_int_t ngx_streaming_handler(ngx_http_request_t *r) {
 
     rc = ngx_http_send_header(r);
 
-    if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    if(rc == NGX_ERROR || rc > NGX_OK) {
       ngx_log_error(NGX_LOG_ALERT, nlog, ngx_errno, ngx_close_file_n "ngx_http_send_header failed");
       return rc;
     }
 
+    // HEAD and not modified responses end here, before a sample is read
+    if(r->header_only) return rc;
+
+    if(ctx->muxer) {
+      if(ctx->range_end && !output_ts_seek(ctx->muxer, ctx->range_start)) return NGX_ERROR;
+#if (NGX_HLS_IO_URING)
+      if(conf->io_uring) return ngx_streaming_uring(r, ctx);
+#endif
+      if(!output_ts_read(ctx->muxer)) return NGX_ERROR;
+
+      return ngx_streaming_start(r, ctx);
+    }
+
     return ngx_http_output_filter(r, bucket->first);
   } else return NGX_HTTP_UNSUPPORTED_MEDIA_TYPE;
 }
 
+static char *ngx_http_hls_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_str_t *value = cf->args->elts;
+
+#if (NGX_THREADS)
+  hls_conf_t *hlcf = conf;
+  ngx_str_t name, *pool = NULL;
+
+  if(hlcf->thread_pool != NGX_CONF_UNSET_PTR) return "is duplicate";
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    hlcf->thread_pool = NULL;
+    return NGX_CONF_OK;
+  }
+
+  if(ngx_strncmp(value[1].data, "pool=", 5) == 0) {
+    name.data = value[1].data + 5;
+    name.len = value[1].len - 5;
+    if(name.len == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid thread pool name \"%V\"", &value[1]);
+      return NGX_CONF_ERROR;
+    }
+    pool = &name;
+  } else if(ngx_strcmp(value[1].data, "on") != 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  // "on" takes the default pool
+  hlcf->thread_pool = ngx_thread_pool_add(cf, pool);
+  if(hlcf->thread_pool == NULL) return NGX_CONF_ERROR;
+
+  return NGX_CONF_OK;
+#else
+  if(ngx_strcmp(value[1].data, "off") == 0) return NGX_CONF_OK;
+
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"hls_threads\" requires nginx built --with-threads");
+  return NGX_CONF_ERROR;
+#endif
+}
+
+static char *ngx_http_hls_directio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  hls_conf_t *hlcf = conf;
+  ngx_str_t *value = cf->args->elts;
+
+  if(hlcf->directio != NGX_CONF_UNSET) return "is duplicate";
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    hlcf->directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+    return NGX_CONF_OK;
+  }
+
+  hlcf->directio = ngx_parse_offset(&value[1]);
+  if(hlcf->directio == (off_t) NGX_ERROR) return "invalid value";
+
+  return NGX_CONF_OK;
+}
+
+static char *ngx_http_hls_io_uring(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+#if (NGX_HLS_IO_URING)
+  return ngx_conf_set_flag_slot(cf, cmd, conf);
+#else
+  ngx_str_t *value = cf->args->elts;
+
+  if(ngx_strcmp(value[1].data, "off") == 0) return NGX_CONF_OK;
+
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"hls_io_uring\" requires nginx built on Linux with io_uring headers");
+  return NGX_CONF_ERROR;
+#endif
+}
+
+// <number> [hugetlb] | off
+static char *ngx_http_hls_output_slabs(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  hls_main_conf_t *hmcf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_int_t n;
+
+  if(hmcf->output_slabs != NGX_CONF_UNSET_UINT) return "is duplicate";
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    if(cf->args->nelts > 2) return "invalid parameter";
+    hmcf->output_slabs = 0;
+    return NGX_CONF_OK;
+  }
+
+  n = ngx_atoi(value[1].data, value[1].len);
+  if(n == NGX_ERROR || n == 0) return "invalid value";
+  hmcf->output_slabs = n;
+
+  if(cf->args->nelts > 2) {
+    if(ngx_strcmp(value[2].data, "hugetlb") != 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+      return NGX_CONF_ERROR;
+    }
+    hmcf->output_slabs_huge = 1;
+  }
+
+  return NGX_CONF_OK;
+}
+
 static char *ngx_streaming(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
   ngx_http_core_loc_conf_t *clcf =
     ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
@@ -41,8 +41,54 @@ typedef struct {
     ngx_flag_t	relative;
     size_t	buffer_size;
     size_t	max_buffer_size;
+    ngx_flag_t	mp4_mmap;
+    off_t	directio;
+    ngx_flag_t	prefetch;
+    size_t	read_window;
+    ngx_shm_zone_t	*index_cache;
+    ngx_flag_t	index_sidecar;
+    ngx_shm_zone_t	*playlist_cache;
+    ngx_shm_zone_t	*segment_cache;
+    ngx_flag_t	segment_cache_lock;
+    ngx_msec_t	segment_cache_lock_timeout;
+    size_t	ts_buffer_size;
+#if (NGX_THREADS)
+    ngx_thread_pool_t	*thread_pool;
+#endif
+    ngx_flag_t	io_uring;
 } hls_conf_t;
 
+typedef struct {
+    struct mp4_split_options_t *options;
+    ngx_file_t *file;
+    ngx_open_file_info_t of;
+    size_t root;
+    u_int m3u8;
+    struct bucket_t *bucket;
+
+    ngx_event_t wait;           // polls the segment cache lock
+    ngx_msec_t wait_start;
+    struct hls_cache_lock_t *lock;  // held while the segment is built
+
+    ngx_str_t key;              // of the cached playlist or segment
+    struct mp4_context_t *mp4_context;
+    int result;
+    unsigned built:1;           // the output is in bucket, or failed
+
+    struct mpegts_muxer_t *muxer;  // of a segment sent while it is muxed
+    ngx_chain_t *out;           // the part that is not passed on yet
+    unsigned muxed:1;
+    off_t range_start;          // of a range that is muxed on its own
+    off_t range_end;            // 0 without one
+} hls_ctx_t;
+
+typedef struct {
+    ngx_array_t	caches;
+    ngx_shm_zone_t	*prefetch;     // hits and misses of hls_prefetch
+    ngx_uint_t	output_slabs;      // most a worker maps, 0 without them
+    ngx_flag_t	output_slabs_huge;
+} hls_main_conf_t;
+
 struct moov_t {
     struct unknown_atom_t *unknown_atoms_;
     struct mvhd_t *mvhd_;
@@ -51,6 +97,10 @@ struct moov_t {
     struct mvex_t *mvex_;
 
     int is_indexed_;
+
+    unsigned int segments_length_;  // hls_length the segments were built for
+    unsigned int segments_size_;
+    struct segment_t *segments_;
 };
 typedef struct moov_t moov_t;
 
@@ -82,10 +132,24 @@ struct mp4_context_t {
     size_t	buffer_size;
     off_t	filesize;
     ngx_flag_t	alignment;
+    ngx_flag_t	map_file;   // read through a mapping, see hls_mp4_mmap
+    u_char	*map;
+    u_char	*index_map;   // the sidecar the sample index is used from
+    size_t	index_map_size;
 };
 typedef struct mp4_context_t mp4_context_t;
 
 static char *ngx_streaming(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_threads(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_directio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_prefetch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_io_uring(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_hls_output_slabs(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void *ngx_http_hls_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_hls_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_streaming_output(ngx_http_request_t *r, hls_ctx_t *ctx);
 static void *ngx_http_hls_create_conf(ngx_conf_t *cf);
 static char *ngx_http_hls_merge_conf(ngx_conf_t *cf, void *parent, void *child);
 
@@ -122,6 +186,111 @@ static ngx_command_t ngx_streaming_commands[] = {
       offsetof(hls_conf_t, max_buffer_size),
       NULL },
 
+    { ngx_string("hls_mp4_mmap"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, mp4_mmap),
+      NULL },
+
+    { ngx_string("hls_directio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_directio,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hls_prefetch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_prefetch,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, prefetch),
+      NULL },
+
+    { ngx_string("hls_read_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, read_window),
+      NULL },
+
+    { ngx_string("hls_index_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, index_cache),
+      NULL },
+
+    { ngx_string("hls_index_sidecar"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, index_sidecar),
+      NULL },
+
+    { ngx_string("hls_playlist_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, playlist_cache),
+      NULL },
+
+    { ngx_string("hls_segment_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, segment_cache),
+      NULL },
+
+    { ngx_string("hls_segment_cache_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, segment_cache_lock),
+      NULL },
+
+    { ngx_string("hls_segment_cache_lock_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, segment_cache_lock_timeout),
+      NULL },
+
+    { ngx_string("hls_threads"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_threads,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hls_ts_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, ts_buffer_size),
+      NULL },
+
+    { ngx_string("hls_io_uring"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_hls_io_uring,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(hls_conf_t, io_uring),
+      NULL },
+
+    { ngx_string("hls_output_slabs"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_hls_output_slabs,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hls_status"),
+      NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+      ngx_http_hls_status,
+      0,
+      0,
+      NULL },
+
   ngx_null_command
 };
 
@@ -129,8 +298,8 @@ static ngx_http_module_t ngx_streaming_module_ctx = {
   NULL,                          /* preconfiguration */
   NULL,                          /* postconfiguration */
 
-  NULL,                          /* create main configuration */
-  NULL,                          /* init main configuration */
+  ngx_http_hls_create_main_conf, /* create main configuration */
+  ngx_http_hls_init_main_conf,   /* init main configuration */
 
   NULL,                          /* create server configuration */
   NULL,                          /* merge server configuration */
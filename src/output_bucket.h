@@ -4,50 +4,304 @@
  For licensing see the LICENSE file
 ******************************************************************************/
 
+// the data is written into blocks that grow from BUCKET_BLOCK_SIZE to
+// BUCKET_MAX_BLOCK_SIZE, so a segment is a few links instead of one per write.
+#define BUCKET_BLOCK_SIZE (64 * 1024)
+#define BUCKET_MAX_BLOCK_SIZE (1024 * 1024)
+
+// with hls_output_slabs the blocks are slabs of BUCKET_MAX_BLOCK_SIZE the
+// worker keeps on a free list between requests. They are mapped a chunk at a
+// time, in huge pages if they are asked for, and never unmapped.
+#define BUCKET_SLAB_CHUNK (2 * 1024 * 1024)
+#define BUCKET_SLABS_PER_CHUNK (BUCKET_SLAB_CHUNK / BUCKET_MAX_BLOCK_SIZE)
+
+struct bucket_slab_t {
+  u_char *data;
+  struct bucket_slab_t *next;
+};
+typedef struct bucket_slab_t bucket_slab_t;
+
+static bucket_slab_t *bucket_slabs;         // the free ones
+static ngx_uint_t bucket_slabs_mapped;
+static ngx_flag_t bucket_slabs_no_huge;     // MAP_HUGETLB failed once
+static ngx_atomic_t bucket_slabs_lock;      // against the threads of hls_threads
+
 struct bucket_t {
     ngx_http_request_t *r;
     ngx_chain_t **chain;
     uint64_t content_length;
     ngx_chain_t *first;
+    ngx_buf_t *block;   // the last block, NULL after a reference
+    ngx_chain_t *free;  // written blocks, see bucket_reset
+    hls_main_conf_t *conf; // NULL without hls_output_slabs
+    bucket_slab_t *slabs;  // taken by the blocks, see bucket_cleanup
 };
 typedef struct bucket_t bucket_t;
 
+// maps a chunk of slabs, returns the first and frees the others
+static bucket_slab_t *bucket_slab_map(ngx_flag_t huge, ngx_log_t *log) {
+  u_char *p = MAP_FAILED;
+  ngx_uint_t i;
+
+#ifdef MAP_HUGETLB
+  if(huge && !bucket_slabs_no_huge) {
+    p = mmap(NULL, BUCKET_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p == MAP_FAILED) {
+      ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "mmap(MAP_HUGETLB) failed, hls_output_slabs uses normal pages");
+      bucket_slabs_no_huge = 1;
+    }
+  }
+#endif
+  if(p == MAP_FAILED) {
+    p = mmap(NULL, BUCKET_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+      ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "mmap(%uz) of output slabs failed", (size_t)BUCKET_SLAB_CHUNK);
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    // transparent huge pages are the next best thing
+    if(huge) madvise(p, BUCKET_SLAB_CHUNK, MADV_HUGEPAGE);
+#endif
+  }
+
+  bucket_slab_t *slabs = ngx_alloc(BUCKET_SLABS_PER_CHUNK * sizeof(bucket_slab_t), log);
+  if(slabs == NULL) {
+    munmap(p, BUCKET_SLAB_CHUNK);
+    return NULL;
+  }
+  for(i = 0; i < BUCKET_SLABS_PER_CHUNK; ++i) slabs[i].data = p + i * BUCKET_MAX_BLOCK_SIZE;
+
+  ngx_spinlock(&bucket_slabs_lock, 1, 2048);
+  for(i = 1; i < BUCKET_SLABS_PER_CHUNK; ++i) {
+    slabs[i].next = bucket_slabs;
+    bucket_slabs = &slabs[i];
+  }
+  ngx_unlock(&bucket_slabs_lock);
+
+  return &slabs[0];
+}
+
+// takes a free slab, or maps more while the worker has fewer than
+// hls_output_slabs. NULL leaves the block to the request pool.
+static bucket_slab_t *bucket_slab_get(bucket_t *bucket) {
+  hls_main_conf_t *conf = bucket->conf;
+  bucket_slab_t *slab;
+  ngx_flag_t map = 0;
+
+  ngx_spinlock(&bucket_slabs_lock, 1, 2048);
+  slab = bucket_slabs;
+  if(slab) bucket_slabs = slab->next;
+  else if(bucket_slabs_mapped < conf->output_slabs) {
+    bucket_slabs_mapped += BUCKET_SLABS_PER_CHUNK;
+    map = 1;
+  }
+  ngx_unlock(&bucket_slabs_lock);
+
+  if(map) {
+    slab = bucket_slab_map(conf->output_slabs_huge, bucket->r->connection->log);
+    if(slab == NULL) {
+      ngx_spinlock(&bucket_slabs_lock, 1, 2048);
+      bucket_slabs_mapped -= BUCKET_SLABS_PER_CHUNK;
+      ngx_unlock(&bucket_slabs_lock);
+    }
+  }
+
+  return slab;
+}
+
+// gives the slabs of the bucket back to the worker once the request is done
+static void bucket_cleanup(void *data) {
+  bucket_t *bucket = data;
+  bucket_slab_t *slab, *next;
+
+  ngx_spinlock(&bucket_slabs_lock, 1, 2048);
+  for(slab = bucket->slabs; slab; slab = next) {
+    next = slab->next;
+    slab->next = bucket_slabs;
+    bucket_slabs = slab;
+  }
+  ngx_unlock(&bucket_slabs_lock);
+
+  bucket->slabs = NULL;
+}
+
+// a block in a slab of the worker, NULL if there is none
+static ngx_buf_t *bucket_slab_block(bucket_t *bucket) {
+  bucket_slab_t *slab = bucket_slab_get(bucket);
+  if(slab == NULL) return NULL;
+  slab->next = bucket->slabs;
+  bucket->slabs = slab;
+
+  ngx_buf_t *b = ngx_calloc_buf(bucket->r->pool);
+  if(b == NULL) return NULL;
+
+  b->start = b->pos = b->last = slab->data;
+  b->end = slab->data + BUCKET_MAX_BLOCK_SIZE;
+  b->temporary = 1;
+
+  return b;
+}
+
 extern bucket_t *bucket_init(ngx_http_request_t *r) {
+  hls_main_conf_t *hmcf = ngx_http_get_module_main_conf(r, ngx_http_streaming_module);
   bucket_t *bucket = (bucket_t *)ngx_pcalloc(r->pool, sizeof(bucket_t));
   bucket->r = r;
   bucket->first = 0;
   bucket->chain = &bucket->first;
   bucket->content_length = 0;
+  bucket->block = NULL;
+  bucket->free = NULL;
+  bucket->conf = NULL;
+  bucket->slabs = NULL;
+
+  // the slabs are given back with the request, after its body is sent
+  if(hmcf->output_slabs) {
+    ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+    if(cln) {
+      cln->handler = bucket_cleanup;
+      cln->data = bucket;
+      bucket->conf = hmcf;
+    }
+  }
 
   return bucket;
 }
 
-extern void bucket_insert(bucket_t *bucket, void const *buf, uint64_t size) {
-  ngx_buf_t *b = ngx_pcalloc(bucket->r->pool, sizeof(ngx_buf_t));
-  if(b == NULL) return;
-
-  b->pos = ngx_pcalloc(bucket->r->pool, size);
-  if(b->pos == NULL) return;
-
+static void bucket_append(bucket_t *bucket, ngx_chain_t *cl) {
   if(bucket->first != 0) {
     (*bucket->chain)->buf->last_buf = 0;
     (*bucket->chain)->buf->last_in_chain = 0;
     bucket->chain = &(*bucket->chain)->next;
   }
-  *bucket->chain = ngx_pcalloc(bucket->r->pool, sizeof(ngx_chain_t));
-  if(*bucket->chain == NULL) return;
+  *bucket->chain = cl;
 
-  b->last = b->pos + size;
-  b->memory = 1;
-  memcpy(b->pos, buf, size);
-  b->last_buf = 1;
-  b->last_in_chain = 1;
+  cl->buf->last_buf = 1;
+  cl->buf->last_in_chain = 1;
+  cl->next = NULL;
+}
+
+// appends a block with room for size bytes, a written one if it is big enough
+static ngx_buf_t *bucket_block(bucket_t *bucket, size_t size) {
+  ngx_chain_t **free, *cl = NULL;
+  for(free = &bucket->free; *free; free = &(*free)->next) {
+    if((size_t)((*free)->buf->end - (*free)->buf->start) >= size) {
+      cl = *free;
+      *free = cl->next;
+      break;
+    }
+  }
+
+  if(cl == NULL) {
+    cl = ngx_alloc_chain_link(bucket->r->pool);
+    if(cl == NULL) return NULL;
+    cl->buf = NULL;
+    if(bucket->conf && size <= BUCKET_MAX_BLOCK_SIZE) cl->buf = bucket_slab_block(bucket);
+    if(cl->buf == NULL) cl->buf = ngx_create_temp_buf(bucket->r->pool, size);
+    if(cl->buf == NULL) return NULL;
+  }
 
-  (*bucket->chain)->buf = b;
-  (*bucket->chain)->next = NULL;
+  bucket_append(bucket, cl);
+  bucket->block = cl->buf;
 
+  return cl->buf;
+}
+
+// appends size bytes to the bucket and returns where to write them
+extern u_char *bucket_reserve(bucket_t *bucket, size_t size) {
+  ngx_buf_t *b = bucket->block;
+
+  if(b == NULL || (size_t)(b->end - b->last) < size) {
+    size_t block_size = b ? (size_t)(b->end - b->start) * 2 : BUCKET_BLOCK_SIZE;
+    if(block_size > BUCKET_MAX_BLOCK_SIZE) block_size = BUCKET_MAX_BLOCK_SIZE;
+    if(block_size < size) block_size = size;
+
+    b = bucket_block(bucket, block_size);
+    if(b == NULL) return NULL;
+  }
+
+  u_char *pos = b->last;
+  b->last += size;
   bucket->content_length += size;
+
+  return pos;
 }
 
-// End Of File
+extern void bucket_insert(bucket_t *bucket, void const *buf, uint64_t size) {
+  u_char *pos = bucket_reserve(bucket, size);
+  if(pos == NULL) return;
+
+  memcpy(pos, buf, size);
+}
+
+// links buf without copying it, so it has to live as long as the request.
+extern void bucket_insert_ref(bucket_t *bucket, void const *buf, uint64_t size) {
+  ngx_chain_t *cl = ngx_alloc_chain_link(bucket->r->pool);
+  if(cl == NULL) return;
+  cl->buf = ngx_calloc_buf(bucket->r->pool);
+  if(cl->buf == NULL) return;
+
+  bucket_append(bucket, cl);
+  bucket->block = NULL;
+
+  cl->buf->memory = 1;
+  cl->buf->pos = (u_char *)buf;
+  cl->buf->last = cl->buf->pos + size;
 
+  bucket->content_length += size;
+}
+
+// the links of the chain between byte start and byte end of the output, where
+// the bytes are counted like content_length. The buffers are cut to the range
+// and the links after end are dropped.
+extern ngx_chain_t *bucket_range(bucket_t *bucket, uint64_t start, uint64_t end) {
+  ngx_chain_t *cl, *out = NULL;
+  uint64_t pos = bucket->content_length;
+
+  for(cl = bucket->first; cl; cl = cl->next) pos -= cl->buf->last - cl->buf->pos;
+
+  for(cl = bucket->first; cl; cl = cl->next) {
+    ngx_buf_t *b = cl->buf;
+    if(pos + (b->last - b->pos) <= start) {
+      pos += b->last - b->pos;
+      continue;
+    }
+    if(pos < start) {
+      b->pos += start - pos;
+      pos = start;
+    }
+    if(out == NULL) out = cl;
+
+    if(pos + (b->last - b->pos) >= end) {
+      b->last = b->pos + (end - pos);
+      b->last_buf = 1;
+      b->last_in_chain = 1;
+      cl->next = NULL;
+      break;
+    }
+    pos += b->last - b->pos;
+  }
+
+  return out;
+}
+
+// keeps the blocks once the chain is written, so the bucket takes the next
+// part of a segment that is sent while it is muxed without allocating.
+extern void bucket_reset(bucket_t *bucket) {
+  ngx_chain_t *cl, *next;
+  for(cl = bucket->first; cl; cl = next) {
+    next = cl->next;
+    if(cl->buf->start == NULL) continue;
+
+    cl->buf->pos = cl->buf->start;
+    cl->buf->last = cl->buf->start;
+    cl->buf->flush = 0;
+    cl->next = bucket->free;
+    bucket->free = cl;
+  }
+
+  bucket->first = 0;
+  bucket->chain = &bucket->first;
+  bucket->block = NULL;
+}
+
+// End Of File
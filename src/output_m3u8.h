@@ -31,7 +31,7 @@ int mp4_create_m3u8(struct mp4_context_t *mp4_context, struct bucket_t *bucket)
   char *ext = strrchr(filename, '.');
   *ext = 0;
 
-  if(!moov_build_index(mp4_context, mp4_context->moov)) return 0;
+  if(!moov_build_segments(mp4_context, mp4_context->moov, conf->length)) return 0;
   moov_t const *moov = mp4_context->moov;
 
   // http://developer.apple.com/library/ios/#technotes/tn2288/_index.html
@@ -57,34 +57,16 @@ int mp4_create_m3u8(struct mp4_context_t *mp4_context, struct bucket_t *bucket)
       }
     }*/
 
-  trak_t const *trak = moov->traks_[0];
-  samples_t *cur = trak->samples_;
-  samples_t *prev = cur;
-  samples_t *last = trak->samples_ + trak->samples_size_ + 1;
-
   p = ngx_sprintf(p, "#EXT-X-TARGETDURATION:%ud\n", conf->length + 3);
   p = ngx_sprintf(p, "#EXT-X-MEDIA-SEQUENCE:0\n");
   p = ngx_sprintf(p, "#EXT-X-VERSION:4\n");
 
-  uint32_t i = 0, prev_i = 0;
-  while(cur != last) {
-    if(!cur->is_smooth_ss_) {
-      ++cur;
-      continue;
-    }
-
-    if(prev != cur) {
-      float duration = (float)((cur->pts_ - prev->pts_) / (float)trak->mdia_->mdhd_->timescale_) + 0.0005;
-      if(duration >= (float)conf->length || cur + 1 == last) {
-        p = ngx_sprintf(p, "#EXTINF:%.3f,\n", duration);
-        p = ngx_sprintf(p, "%s.ts?video=%uD%s\n", filename, prev_i, extra);
-        prev = cur;
-        prev_i = i;
-        ++result;
-      }
-    }
-    ++i;
-    ++cur;
+  uint32_t i;
+  for(i = 0; i != moov->segments_size_; ++i) {
+    segment_t const *segment = &moov->segments_[i];
+    p = ngx_sprintf(p, "#EXTINF:%.3f,\n", segment->duration_);
+    p = ngx_sprintf(p, "%s.ts?video=%uD%s\n", filename, segment->start_, extra);
+    ++result;
   }
   p = ngx_sprintf(p, "#EXT-X-ENDLIST\n");
 
@@ -95,5 +77,46 @@ int mp4_create_m3u8(struct mp4_context_t *mp4_context, struct bucket_t *bucket)
   return result;
 }
 
+// A cached playlist is the number of segments followed by the playlist. The
+// key covers everything the playlist is rendered from.
+static int m3u8_cache_read(ngx_http_request_t *r, ngx_str_t *key, ngx_file_t const *file,
+                           ngx_open_file_info_t const *of, size_t root, bucket_t *bucket) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  ngx_str_t extra, none = ngx_null_string;
+
+  if(conf->playlist_cache == NULL) return 0;
+
+  // absolute links name the server
+  ngx_str_t const *server = conf->relative ? &none : &r->headers_in.server;
+
+  extra.len = 3 * (NGX_INT_T_LEN + 1) + server->len + 1 + r->args.len;
+  extra.data = ngx_pnalloc(r->pool, extra.len);
+  if(extra.data == NULL) return 0;
+
+  extra.len = ngx_sprintf(extra.data, "%ui:%i:%uz:%V:%V", conf->length, conf->relative, root,
+                          server, &r->args) - extra.data;
+  if(!hls_cache_key(r, key, 'p', &file->name, of, &extra)) return 0;
+
+  hls_cache_node_t *node = hls_cache_lookup(r, conf->playlist_cache, key);
+  if(node == NULL) return 0;
+
+  bucket_insert_ref(bucket, node->data + sizeof(uint64_t), node->size - sizeof(uint64_t));
+
+  return (int)*(uint64_t *)node->data;
+}
+
+// the playlist may be in several buffers, they are stored behind the count
+static void m3u8_cache_write(ngx_http_request_t *r, ngx_str_t *key, bucket_t *bucket, int segments) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  uint64_t count = segments;
+  ngx_buf_t b;
+  ngx_chain_t in = { &b, bucket->first };
+
+  b.pos = (u_char *)&count;
+  b.last = b.pos + sizeof(uint64_t);
+
+  hls_cache_insert_chain(conf->playlist_cache, key, &in, sizeof(uint64_t) + bucket->content_length);
+}
+
 // End Of File
 
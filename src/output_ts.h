@@ -18,6 +18,10 @@
 // or when the dts delta is over AUDIO_DELTA
 #define AUDIO_DELTA (500 * (90000 / 1000))
 
+// the samples of a segment are read in spans of neighbouring chunks, a gap of
+// up to TS_READ_GAP bytes between them is read instead of splitting a span
+#define TS_READ_GAP (32 * 1024)
+
 // resend PAT/PMT every 100ms
 //#define PAT_DELTA (100 * (90000 / 1000))
 #define PAT_DELTA (60 * 1000 * (90000 / 1000))
@@ -33,31 +37,96 @@ static void write_pts(uint8_t *q, int fourbits, int64_t pts) {
   *q++ = val;
 }
 
-static u_int convert_to_nal(unsigned char const *first,
-                            unsigned char const *last,
-                            unsigned char *dst) {
+// checks that the NAL units of a sample can be given start codes
+static u_int is_nal_sample(unsigned char const *first,
+                           unsigned char const *last) {
 #if 1
   // check if data is already in nal format. Shouldn't be necessary and this
   // is only a hack for Live Smooth Streaming
-  if(read_32(first) == 0x00000001) {
-    memcpy(dst, first, last - first);
-    return 1;
-  }
+  if(read_32(first) == 0x00000001) return 1;
 #endif
 
   while(first < last) {
     uint32_t packet_len = read_32(first);
     if(packet_len > (uint32_t)(last - first)) return 0;
-    first += 4;
+    first += 4 + packet_len;
+  }
+  return 1;
+}
+
+// the payload of a PES packet, read while it is packetized: a few pieces that
+// are copied as they are, then the sample. The NAL unit lengths in a video
+// sample become start codes on the way, so it is copied only once.
+#define PES_PIECES 5
+
+struct pes_payload_t {
+  u_int pieces_;
+  u_int piece_;
+  unsigned char const *first_[PES_PIECES];
+  unsigned char const *last_[PES_PIECES];
+
+  unsigned char const *sample_;
+  unsigned char const *sample_last_;
+  unsigned char const *nal_;   // the next NAL length, NULL to copy as is
+  unsigned char const *code_;  // the NAL length being replaced
+};
+typedef struct pes_payload_t pes_payload_t;
+
+static void pes_payload_init(pes_payload_t *payload) {
+  payload->pieces_ = 0;
+  payload->piece_ = 0;
+  payload->sample_ = NULL;
+  payload->sample_last_ = NULL;
+  payload->nal_ = NULL;
+  payload->code_ = NULL;
+}
+
+static void pes_payload_add(pes_payload_t *payload, unsigned char const *first, unsigned char const *last) {
+  payload->first_[payload->pieces_] = first;
+  payload->last_[payload->pieces_] = last;
+  ++payload->pieces_;
+}
+
+static void pes_payload_read(pes_payload_t *payload, unsigned char *dst, u_int size) {
+  static const unsigned char start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
 
-    write_32(dst, 0x00000001);
-    dst += 4;
+  while(size && payload->piece_ != payload->pieces_) {
+    u_int piece = payload->piece_;
+    u_int n = payload->last_[piece] - payload->first_[piece];
+    if(n > size) n = size;
 
-    memcpy(dst, first, packet_len);
-    first += packet_len;
-    dst += packet_len;
+    memcpy(dst, payload->first_[piece], n);
+    dst += n;
+    size -= n;
+    payload->first_[piece] += n;
+    if(payload->first_[piece] == payload->last_[piece]) ++payload->piece_;
+  }
+
+  while(size) {
+    unsigned char const *p = payload->sample_;
+    u_int n;
+
+    if(p == payload->nal_) {
+      payload->code_ = p;
+      payload->nal_ = p + 4 + read_32(p);
+    }
+
+    if(payload->code_ && p < payload->code_ + 4) {
+      n = payload->code_ + 4 - p;
+      if(n > size) n = size;
+      memcpy(dst, start_code + (p - payload->code_), n);
+    } else {
+      unsigned char const *end = payload->sample_last_;
+      if(payload->nal_ && payload->nal_ < end) end = payload->nal_;
+      n = end - p;
+      if(n > size) n = size;
+      memcpy(dst, p, n);
+    }
+
+    dst += n;
+    size -= n;
+    payload->sample_ += n;
   }
-  return 1;
 }
 
 static uint32_t const crc32[256] = {
@@ -179,13 +248,37 @@ static void mpegts_stream_exit(struct mp4_context_t *mp4_context, mpegts_stream_
 }
 
 struct fragment_t {
-  trak_t *trak;
-  samples_t *first;
-  samples_t *last;
+  trak_t const *trak;
+  sample_cursor_t first;
+  sample_cursor_t start; // to rewind the muxer
+  sample_cursor_t payload; // where the audio payload a seek left starts
+  unsigned int payload_skip;
+  unsigned int last;
+  uint64_t dts; // of the first sample, in 90KHz
+  uint64_t pts;
   struct mpegts_stream_t *stream;
 };
 typedef struct fragment_t fragment_t;
 
+// convert time values of the first sample to 90KHz clock
+static void fragment_time(fragment_t *fragment) {
+  fragment->dts = sample_cursor_dts(&fragment->first);
+  fragment->pts = sample_cursor_pts(&fragment->first);
+}
+
+static void fragment_next(fragment_t *fragment) {
+  sample_cursor_next(&fragment->first);
+  fragment_time(fragment);
+}
+
+// a run of the file that is read, and where it is in the data of the muxer
+struct mpegts_span_t {
+  uint64_t pos_;
+  uint64_t end_;
+  size_t offset_;
+};
+typedef struct mpegts_span_t mpegts_span_t;
+
 struct mpegts_muxer_t {
   bucket_t *bucket_;
   mp4_context_t *mp4_context_;
@@ -195,6 +288,23 @@ struct mpegts_muxer_t {
   uint64_t next_pat_;
   int pat_cc_;
   int pmt_cc_;
+
+  // the samples of all fragments and where muxing stopped
+  unsigned char *data_;
+  mpegts_span_t *spans_;
+  u_int spans_size_;
+
+  // with hls_read_window the spans of the segment are in reads_, and data_
+  // and spans_ hold the window of them that is read
+  size_t window_;
+  mpegts_span_t *reads_;
+  u_int reads_size_;
+  size_t data_size_;
+  int order_;
+  int size_only_; // only count the bytes, see output_ts_size
+
+  u_int audio_;
+  unsigned int next_; // sync sample the next segment starts with
 };
 typedef struct mpegts_muxer_t mpegts_muxer_t;
 
@@ -209,6 +319,15 @@ static mpegts_muxer_t *mpegts_muxer_init(struct mp4_context_t *mp4_context, buck
   mpegts_muxer->next_pat_ = NOPTS_VALUE;
   mpegts_muxer->pat_cc_ = 0;
   mpegts_muxer->pmt_cc_ = 0;
+  mpegts_muxer->data_ = NULL;
+  mpegts_muxer->spans_ = NULL;
+  mpegts_muxer->spans_size_ = 0;
+  mpegts_muxer->window_ = 0;
+  mpegts_muxer->reads_ = NULL;
+  mpegts_muxer->reads_size_ = 0;
+  mpegts_muxer->data_size_ = 0;
+  mpegts_muxer->order_ = -1;
+  mpegts_muxer->size_only_ = 0;
 
   return mpegts_muxer;
 }
@@ -225,8 +344,7 @@ static void mpegts_muxer_exit(struct mp4_context_t *mp4_context, mpegts_muxer_t
 // Program Association Table lists all the programs available in the transport
 // stream.
 static void mpegts_muxer_write_pat(mpegts_muxer_t *mpegts_muxer) {
-  unsigned char packet[TS_PACKET_SIZE];
-  uint8_t *q = packet;
+  uint8_t *packet, *q;
   uint8_t *section_start;
   uint8_t *section_end;
 
@@ -236,6 +354,15 @@ static void mpegts_muxer_write_pat(mpegts_muxer_t *mpegts_muxer) {
   const int pat_table_id = 0x00;
   const int default_transport_stream_id = 0x0001;
 
+  if(mpegts_muxer->size_only_) {
+    mpegts_muxer->bucket_->content_length += TS_PACKET_SIZE;
+    mpegts_muxer->pat_cc_ = (mpegts_muxer->pat_cc_ + 1) & 0xf;
+    return;
+  }
+
+  packet = q = bucket_reserve(mpegts_muxer->bucket_, TS_PACKET_SIZE);
+  if(packet == NULL) return;
+
   // packet header
   q = write_8(q, 0x47);
   q = write_16(q, 0x4000 | PAT_PID);
@@ -270,14 +397,11 @@ static void mpegts_muxer_write_pat(mpegts_muxer_t *mpegts_muxer) {
   crc = get_crc32(crc, section_start, section_end - section_start);
   q = write_32(q, crc);
   memset(q, 0xff, packet + TS_PACKET_SIZE - q);
-
-  bucket_insert(mpegts_muxer->bucket_, packet, TS_PACKET_SIZE);
 }
 
 // Program Map Tables contain information about programs.
 static void mpegts_muxer_write_pmt(mpegts_muxer_t *mpegts_muxer) {
-  unsigned char packet[TS_PACKET_SIZE];
-  uint8_t *q = packet;
+  uint8_t *packet, *q;
   uint8_t *section_start;
   uint8_t *section_end;
   const int pmt_table_id = 0x02;
@@ -286,6 +410,15 @@ static void mpegts_muxer_write_pmt(mpegts_muxer_t *mpegts_muxer) {
   int section_payload_len = 4;
   section_payload_len += mpegts_muxer->fragment_size_ * 5;
 
+  if(mpegts_muxer->size_only_) {
+    mpegts_muxer->bucket_->content_length += TS_PACKET_SIZE;
+    mpegts_muxer->pmt_cc_ = (mpegts_muxer->pmt_cc_ + 1) & 0xf;
+    return;
+  }
+
+  packet = q = bucket_reserve(mpegts_muxer->bucket_, TS_PACKET_SIZE);
+  if(packet == NULL) return;
+
   // packet header
   q = write_8(q, 0x47);
   q = write_16(q, 0x4000 | PMT_PID);
@@ -331,8 +464,6 @@ static void mpegts_muxer_write_pmt(mpegts_muxer_t *mpegts_muxer) {
   crc = get_crc32(crc, section_start, section_end - section_start);
   q = write_32(q, crc);
   memset(q, 0xff, packet + TS_PACKET_SIZE - q);
-
-  bucket_insert(mpegts_muxer->bucket_, packet, TS_PACKET_SIZE);
 }
 
 static void write_header(mpegts_muxer_t *mpegts_muxer) {
@@ -372,7 +503,7 @@ static int packetized_packets(mpegts_stream_t *mpegts_stream,
 
 static void write_packet(mpegts_stream_t *mpegts_stream,
                          bucket_t *bucket, uint64_t dts, uint64_t pts,
-                         unsigned char const *payload, int payload_size) {
+                         pes_payload_t *payload, int payload_size) {
   unsigned char *buf;
   unsigned char *q;
 
@@ -397,8 +528,31 @@ static void write_packet(mpegts_stream_t *mpegts_stream,
 
   // reserve the exact number of packets we need for this payload
   packets = packetized_packets(mpegts_stream, dts, pts, payload_size);
+  // the continuity counters are kept for output_ts_seek
+  if(mpegts_muxer->size_only_) {
+    mpegts_stream->packets_ += packets;
+    mpegts_stream->cc_ = (mpegts_stream->cc_ + packets) & 0xf;
+    bucket->content_length += packets * TS_PACKET_SIZE;
+    return;
+  }
+
+  // without a payload the space is filled with null packets
+  if(payload == NULL) {
+    mpegts_stream->packets_ += packets;
+    for(; packets; --packets) {
+      q = bucket_reserve(bucket, TS_PACKET_SIZE);
+      if(q == NULL) return;
+      q = write_8(q, 0x47);
+      q = write_16(q, 0x1fff);
+      q = write_8(q, 0x10);
+      memset(q, 0xff, TS_PACKET_SIZE - 4);
+    }
+    return;
+  }
+
+  // the packets are written straight into the bucket
   size_t out_size = packets * TS_PACKET_SIZE;
-  unsigned char *out_buf = (unsigned char *)malloc(out_size);
+  unsigned char *out_buf = bucket_reserve(bucket, out_size);
   if(out_buf == NULL) return;
   buf = out_buf;
 
@@ -559,8 +713,7 @@ static void write_packet(mpegts_stream_t *mpegts_stream,
       }
 #endif
 
-      memcpy(buf + TS_PACKET_SIZE - len, payload, len);
-      payload += len;
+      pes_payload_read(payload, buf + TS_PACKET_SIZE - len, len);
       payload_size -= len;
       ++mpegts_stream->packets_;
     }
@@ -570,18 +723,20 @@ static void write_packet(mpegts_stream_t *mpegts_stream,
   if(buf != (unsigned char const *)out_buf + out_size) {
     printf("write_packet: incorrect number of packets\n");
   }
-  bucket_insert(bucket, out_buf, out_size);
-  free(out_buf);
 }
 
 static void flush_audio_packet(mpegts_stream_t *mpegts_stream,
                                bucket_t *bucket) {
   if(mpegts_stream->payload_index_) {
+    pes_payload_t payload;
+    pes_payload_init(&payload);
+    pes_payload_add(&payload, mpegts_stream->payload_, mpegts_stream->payload_ + mpegts_stream->payload_index_);
+
     write_packet(mpegts_stream,
                  bucket,
                  mpegts_stream->payload_dts_,
                  mpegts_stream->payload_pts_,
-                 mpegts_stream->payload_,
+                 &payload,
                  mpegts_stream->payload_index_);
 
     mpegts_stream->payload_index_ = 0;
@@ -590,64 +745,73 @@ static void flush_audio_packet(mpegts_stream_t *mpegts_stream,
   }
 }
 
+// first is NULL when the muxer only counts the bytes
 static void write_video_packet(mpegts_stream_t *mpegts_stream,
                                bucket_t *bucket,
                                uint64_t dts, uint64_t pts,
                                unsigned char const *first,
-                               unsigned char const *last) {
+                               unsigned int first_size) {
   static const unsigned char aud_nal[6] = {
     0x00, 0x00, 0x00, 0x01, 0x09, 0xe0
   };
+  static const unsigned char start_code[4] = {
+    0x00, 0x00, 0x00, 0x01
+  };
+  sample_entry_t const *sample_entry = mpegts_stream->sample_entry_;
+  pes_payload_t payload;
 
-  u_int size = last - first + sizeof(aud_nal);
+  u_int size = first_size + sizeof(aud_nal);
   if(size < 50) return;
 
   if(mpegts_stream->packets_ == 0) {
-    size += 4 + mpegts_stream->sample_entry_->sps_length_ +
-            4 + mpegts_stream->sample_entry_->pps_length_;
+    size += 4 + sample_entry->sps_length_ +
+            4 + sample_entry->pps_length_;
   }
 
-  unsigned char *buf = (unsigned char *)malloc(size + 10);
-  if(buf == NULL) return;
-  unsigned char *p = buf;
+  // a sample with broken NAL lengths is replaced by null packets, which
+  // keeps the size the muxer counted without looking at the samples
+  if(first == NULL || !is_nal_sample(first, first + first_size)) {
+    write_packet(mpegts_stream, bucket, dts, pts, NULL, size);
+    return;
+  }
 
-  memcpy(p, aud_nal, sizeof(aud_nal));
-  p += sizeof(aud_nal);
+  pes_payload_init(&payload);
+  pes_payload_add(&payload, aud_nal, aud_nal + sizeof(aud_nal));
 
   if(mpegts_stream->packets_ == 0) {
     // sps
-    p = write_32(p, 1);
-    memcpy(p, mpegts_stream->sample_entry_->sps_,
-           mpegts_stream->sample_entry_->sps_length_);
-    p += mpegts_stream->sample_entry_->sps_length_;
+    pes_payload_add(&payload, start_code, start_code + 4);
+    pes_payload_add(&payload, sample_entry->sps_, sample_entry->sps_ + sample_entry->sps_length_);
 
     // pps
-    p = write_32(p, 1);
-    memcpy(p, mpegts_stream->sample_entry_->pps_,
-           mpegts_stream->sample_entry_->pps_length_);
-    p += mpegts_stream->sample_entry_->pps_length_;
+    pes_payload_add(&payload, start_code, start_code + 4);
+    pes_payload_add(&payload, sample_entry->pps_, sample_entry->pps_ + sample_entry->pps_length_);
   }
 
-  if(convert_to_nal(first, last, p)) {
-    write_packet(mpegts_stream, bucket, dts, pts, buf, size);
-  }
+  payload.sample_ = first;
+  payload.sample_last_ = first + first_size;
+  if(read_32(first) != 0x00000001) payload.nal_ = first;
 
-  free(buf);
+  write_packet(mpegts_stream, bucket, dts, pts, &payload, size);
 }
 
+// first is NULL when the muxer only counts the bytes
 static void write_audio_packet(mpegts_stream_t *mpegts_stream,
                                bucket_t *bucket,
                                uint64_t dts, uint64_t pts,
                                unsigned char const *first,
-                               unsigned char const *last) {
-  while(first != last) {
+                               unsigned int first_size) {
+  while(first_size) {
     unsigned int size = MAX_PES_PAYLOAD_SIZE - mpegts_stream->payload_index_;
     int flush = 0;
 
-    if(size > (unsigned int)(last - first)) size = last - first;
-    memcpy(mpegts_stream->payload_ + mpegts_stream->payload_index_, first, size);
+    if(size > first_size) size = first_size;
+    if(first) {
+      memcpy(mpegts_stream->payload_ + mpegts_stream->payload_index_, first, size);
+      first += size;
+    }
 
-    first += size;
+    first_size -= size;
     mpegts_stream->payload_index_ += size;
 
     if(mpegts_stream->payload_index_ == MAX_PES_PAYLOAD_SIZE) flush = 1;
@@ -661,203 +825,893 @@ static void write_audio_packet(mpegts_stream_t *mpegts_stream,
 
 ////////////////////////////////////////////////////////////////////////////////
 
-samples_t *get_next(trak_t const *trak, samples_t *sample, samples_t *last, u_int seconds, unsigned int *last_chunk) {
-  if(sample == last) return sample;
-
-  samples_t *next = sample + 1;
-  u_int i = 0;
-  while(next != last) {
-    if(!next->is_smooth_ss_) {
-      ++next;
-      continue;
-    }
-    float duration = (float)((next->pts_ - sample->pts_) / (float)trak->mdia_->mdhd_->timescale_) + 0.0005;
-    if(!(*last_chunk) && duration >= seconds) break;
-    if(*last_chunk && *last_chunk == i) break;
-    ++next;
-    ++i;
-  }
-  if(!(*last_chunk)) *last_chunk = i;
-  return next;
-}
-
-int output_ts(struct mp4_context_t *mp4_context, struct bucket_t *bucket, struct mp4_split_options_t const *options) {
-  hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_streaming_module);
-  u_int audio = options->fragment_track_id ? options->fragment_track_id : 1;
+// fills fragment with the tracks of segment and returns how many there are.
+// The first trak is cut where the segment table says, the other traks at the
+// same sync samples.
+static u_int output_ts_fragments(struct mp4_context_t *mp4_context, u_int audio, segment_t const *segment,
+                                 fragment_t *fragment, u_int max_fragment_size) {
   uint32_t mark_video = FOURCC('v', 'i', 'd', 'e'), mark_sound = FOURCC('s', 'o', 'u', 'n');
 
-  moov_t const *moov = mp4_context->moov;
-  if(!moov_build_index(mp4_context, mp4_context->moov)) return 0;
+  moov_t *moov = mp4_context->moov;
 
-  uint32_t track_id, i, audio_tracks = 0, last_track = 0, last_chunk = 0, max_fragment_size = 2;
-
-  fragment_t fragment[max_fragment_size];
-  for(track_id = 0; track_id < max_fragment_size; ++track_id) fragment[track_id].trak = NULL;
+  uint32_t track_id, audio_tracks = 0, last_track = 0;
 
   for(track_id = 0; track_id < moov->tracks_; ++track_id) {
     MP4_INFO("track_id %d", track_id);
 
     trak_t const *trak = moov->traks_[track_id];
-    samples_t *sample = trak->samples_;
-    if(!sample) {
+
+    if(trak->mdia_->hdlr_->handler_type_ == mark_sound) {
+      if(track_id != audio) continue;
+    } else if(trak->mdia_->hdlr_->handler_type_ != mark_video) continue;
+
+    // only the traks that go into the fragment are indexed
+    if(!moov_build_trak_index(mp4_context, moov, moov->traks_[track_id])) return 0;
+    if(!trak->sample_sizes_) {
       MP4_ERROR("%s", "sample is null");
       return 0;
     }
-    samples_t *last = trak->samples_ + trak->samples_size_;
 
-    u_int i = 0;
+    unsigned int first, last;
+    if(track_id == 0) {
+      first = segment->first_;
+      last = segment->last_;
+    } else {
+      if(segment->start_ && segment->start_ >= trak->sync_size_) continue;
+      first = segment->start_ ? trak->sync_[segment->start_] : 0;
+      last = trak->sync_[segment->end_ < trak->sync_size_ ? segment->end_ : trak->sync_size_];
+    }
 
-    while(sample != last) {
-      if(!sample->is_smooth_ss_) {
-        ++sample;
-        continue;
-      }
+    if(trak->mdia_->hdlr_->handler_type_ == mark_sound) ++audio_tracks;
+    if(last_track == max_fragment_size) continue;
 
-      int end = 0;
+    fragment[last_track].trak = moov->traks_[track_id];
+    sample_cursor_init(&fragment[last_track].first, trak, first);
+    fragment[last_track].start = fragment[last_track].first;
+    fragment[last_track].payload = fragment[last_track].first;
+    fragment[last_track].last = last;
+    ++last_track;
+  }
 
-      if(trak->mdia_->hdlr_->handler_type_ == mark_sound) {
-        if(track_id != audio) {end = 2; break;}
-        if(options->fragment_start == i) {
-          ++audio_tracks;
-          end = 1;
-        }
-      } else if(trak->mdia_->hdlr_->handler_type_ == mark_video && options->fragment_start == i) {
-        end = 1;
-      }
+  if(!fragment[0].trak) return 0;
 
-      if(end == 1 && last_track < max_fragment_size) {
-        fragment[last_track].trak = moov->traks_[track_id];
-        fragment[last_track].first = sample;
-        fragment[last_track].last = get_next(trak, sample, last, conf->length, &last_chunk);
-        //MP4_INFO("fragment begin %ld end %ld", sample->pts_, fragment[last_track].last->pts_);
-        ++last_track;
-      }
-      if(end) break;
-      ++sample;
-      ++i;
-    }
+  u_int fragment_size = 1 + audio_tracks;
+  if(fragment_size > max_fragment_size) fragment_size = max_fragment_size;
+
+  return fragment_size;
+}
+
+// selects the fragments of the segment and prepares the muxer. The size is
+// known from here on, output_ts_read and output_ts_mux then write the segment
+// to the bucket.
+static mpegts_muxer_t *output_ts_open(struct mp4_context_t *mp4_context, struct bucket_t *bucket, struct mp4_split_options_t const *options) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_streaming_module);
+  u_int audio = options->fragment_track_id ? options->fragment_track_id : 1;
+  uint32_t mark_video = FOURCC('v', 'i', 'd', 'e'), mark_sound = FOURCC('s', 'o', 'u', 'n');
+
+  uint32_t i, max_fragment_size = 2;
+
+  if(!moov_build_segments(mp4_context, mp4_context->moov, conf->length)) return NULL;
+  segment_t const *segment = moov_segment(mp4_context->moov, options->fragment_start);
+  if(segment == NULL) {
+    MP4_ERROR("no segment starts with sync sample %"PRIu64, options->fragment_start);
+    return NULL;
   }
 
-  if(!fragment[0].trak) {
+  // the muxer keeps the fragments until the segment is written
+  fragment_t *fragment = (fragment_t *)ngx_pcalloc(mp4_context->r->pool, sizeof(fragment_t) * max_fragment_size);
+  if(fragment == NULL) return NULL;
+
+  u_int fragment_size = output_ts_fragments(mp4_context, audio, segment, fragment, max_fragment_size);
+
+  if(!fragment_size) {
     MP4_ERROR("%s", "no video fragment");
-    return 0;
+    return NULL;
   }
 
-  u_int fragment_size = 1 + audio_tracks;
-  if(fragment_size > max_fragment_size) fragment_size = max_fragment_size;
+  for(i = 0; i < fragment_size; ++i) {
+    if(fragment[i].trak == NULL) continue;
+    fragment_time(&fragment[i]);
+    MP4_INFO("fragment %u begin %ld end %ld", i, sample_cursor_pos(&fragment[i].first), trak_sample_pos(fragment[i].trak, fragment[i].last));
+  }
+
+  mpegts_muxer_t *muxer = mpegts_muxer_init(mp4_context, bucket, fragment, fragment_size);
+  muxer->audio_ = audio;
+  muxer->next_ = segment->end_;
+  muxer->window_ = conf->read_window;
 
   for(i = 0; i < fragment_size; ++i) {
     if(fragment[i].trak == NULL) continue;
-    samples_t *next = fragment[i].first;
-    // convert time values to 90KHz clock
-    while(1) {
-      next->pts_ = trak_time_to_moov_time(next->pts_, 90000, fragment[i].trak->mdia_->mdhd_->timescale_);
-      next->cto_ = trak_time_to_moov_time(next->cto_, 90000, fragment[i].trak->mdia_->mdhd_->timescale_);
-      if(next == fragment[i].last) break;
-      ++next;
-    }
-    MP4_INFO("fragment %u begin %ld end %ld", i, fragment[i].first->pos_, fragment[i].last->pos_);
+    if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_sound) {
+      fragment[i].stream = mpegts_stream_init(mp4_context, muxer, 0, START_PID + i, &fragment[i].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0]);
+    } else if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_video)
+      fragment[i].stream = mpegts_stream_init(mp4_context, muxer, 1, START_PID + i, &fragment[i].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0]);
   }
-  {
-    mpegts_muxer_t *muxer = mpegts_muxer_init(mp4_context, bucket, fragment, fragment_size);
 
+  write_header(muxer);
+
+  uint64_t offset = 0xFFFFFFFFFFFFFFFFULL;
+  {
+    uint64_t pos_end = 0;
     for(i = 0; i < fragment_size; ++i) {
       if(fragment[i].trak == NULL) continue;
-      if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_sound) {
-        fragment[i].stream = mpegts_stream_init(mp4_context, muxer, 0, START_PID + i, &fragment[i].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0]);
-      } else if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_video)
-        fragment[i].stream = mpegts_stream_init(mp4_context, muxer, 1, START_PID + i, &fragment[i].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0]);
+      uint64_t first_pos = sample_cursor_pos(&fragment[i].first);
+      uint64_t last_pos = trak_sample_pos(fragment[i].trak, fragment[i].last);
+      uint64_t size = last_pos - first_pos;
+      uint64_t limit = 0;
+      if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_sound) limit = 1024 * 1024 * 10;
+      else if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_video) limit = 1024 * 1024 * 50;
+      if(size > limit) {
+        MP4_ERROR("segment %d is too big: %ld - %ld", i, first_pos, last_pos);
+        return NULL;
+      }
+      if(first_pos < offset) offset = first_pos;
+      if(last_pos > pos_end) pos_end = last_pos;
     }
+    //MP4_INFO("fragment start %"PRIi64" end %"PRIi64, offset, pos_end);
+    if(!pos_end || offset == 0xFFFFFFFFFFFFFFFFULL) return NULL; // sanity check
+  }
 
-    write_header(muxer);
+  return muxer;
+}
 
-    uint64_t offset = 0xFFFFFFFFFFFFFFFFULL;
-    unsigned char *data = NULL;
-    {
-      uint64_t pos_end = 0;
-      for(i = 0; i < fragment_size; ++i) {
-        if(fragment[i].trak == NULL) continue;
-        uint64_t size = fragment[i].last->pos_ - fragment[i].first->pos_;
-        uint64_t limit = 0;
-        if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_sound) limit = 1024 * 1024 * 10;
-        else if(fragment[i].trak->mdia_->hdlr_->handler_type_ == mark_video) limit = 1024 * 1024 * 50;
-        if(size > limit) {
-          MP4_ERROR("segment %d is too big: %ld - %ld", i, fragment[i].first->pos_, fragment[i].last->pos_);
-          return 0;
-        }
-        if(fragment[i].first->pos_ < offset) offset = fragment[i].first->pos_;
-        if(fragment[i].last->pos_ > pos_end) pos_end = fragment[i].last->pos_;
+// the span that file position pos is in, if it was read
+static u_int mpegts_muxer_span(mpegts_muxer_t const *muxer, uint64_t pos) {
+  u_int first = 0, last = muxer->spans_size_;
+
+  while(last - first > 1) {
+    u_int middle = first + (last - first) / 2;
+    if(muxer->spans_[middle].pos_ <= pos) first = middle;
+    else last = middle;
+  }
+
+  return first;
+}
+
+// the data read for the sample at file position pos
+static unsigned char const *mpegts_muxer_data(mpegts_muxer_t const *muxer, uint64_t pos) {
+  mpegts_span_t const *span = &muxer->spans_[mpegts_muxer_span(muxer, pos)];
+
+  return muxer->data_ + span->offset_ + (pos - span->pos_);
+}
+
+// copies the audio a seek left in the PES payload of a stream, which is the
+// last payload_index_ bytes of the ADTS headers and samples before first.
+static void fragment_refill(mpegts_muxer_t *muxer, fragment_t *fragment) {
+  mpegts_stream_t *stream = fragment->stream;
+  sample_cursor_t cursor = fragment->payload;
+  unsigned int skip = fragment->payload_skip;
+  int index = 0;
+
+  for(; index < stream->payload_index_; sample_cursor_next(&cursor)) {
+    unsigned int size = sample_cursor_size(&cursor), n;
+    uint8_t adts[7];
+
+    sample_entry_get_adts(stream->sample_entry_, size, adts);
+    if(skip < 7) {
+      n = 7 - skip;
+      if(n > (unsigned int)(stream->payload_index_ - index)) n = stream->payload_index_ - index;
+      memcpy(stream->payload_ + index, adts + skip, n);
+      index += n;
+      skip = 7;
+    }
+
+    n = 7 + size - skip;
+    if(n > (unsigned int)(stream->payload_index_ - index)) n = stream->payload_index_ - index;
+    memcpy(stream->payload_ + index, mpegts_muxer_data(muxer, sample_cursor_pos(&cursor)) + skip - 7, n);
+    index += n;
+    skip = 0;
+  }
+}
+
+static int mpegts_span_cmp(const void *one, const void *two) {
+  mpegts_span_t const *a = one, *b = two;
+
+  return a->pos_ < b->pos_ ? -1 : a->pos_ > b->pos_;
+}
+
+// the chunks of the segment, from the first sample still needed of every
+// fragment, instead of everything between the lowest and the highest sample.
+// Chunks of tracks that are not muxed, like other audio languages, are
+// skipped once the gap to them is over TS_READ_GAP. Returns the spans sorted
+// by position, or NULL if nothing is left to read.
+static mpegts_span_t *mpegts_spans(mp4_context_t *mp4_context, fragment_t *fragment, u_int fragment_size,
+                                   u_int *spans_size, uint64_t *used) {
+  u_int i, n = 0, k;
+
+  for(i = 0; i < fragment_size; ++i) {
+    if(fragment[i].trak == NULL || fragment[i].payload.sample_ >= fragment[i].last) continue;
+    n += trak_sample_chunk(fragment[i].trak, fragment[i].last - 1) - fragment[i].payload.chunk_ + 1;
+  }
+  if(n == 0) return NULL;
+
+  mpegts_span_t *spans = ngx_palloc(mp4_context->r->pool, sizeof(mpegts_span_t) * n);
+  if(spans == NULL) return NULL;
+
+  // the samples of a chunk follow each other, so each chunk is one span
+  n = 0;
+  *used = 0;
+  for(i = 0; i < fragment_size; ++i) {
+    trak_t const *trak = fragment[i].trak;
+    if(trak == NULL || fragment[i].payload.sample_ >= fragment[i].last) continue;
+
+    unsigned int chunk = fragment[i].payload.chunk_, last_chunk = trak_sample_chunk(trak, fragment[i].last - 1);
+    for(; chunk <= last_chunk; ++chunk) {
+      unsigned int first = trak->chunks_[chunk].sample_, last = first + trak->chunks_[chunk].size_;
+      if(first < fragment[i].payload.sample_) first = fragment[i].payload.sample_;
+      if(last > fragment[i].last) last = fragment[i].last;
+      if(first >= last) continue;
+
+      spans[n].pos_ = trak->chunks_[chunk].pos_ + trak->sample_offsets_[first];
+      spans[n].end_ = trak->chunks_[chunk].pos_ + trak->sample_offsets_[last - 1] + trak->sample_sizes_[last - 1];
+      *used += spans[n].end_ - spans[n].pos_;
+
+      // direct I/O reads whole blocks
+      if(mp4_context->alignment) {
+        spans[n].pos_ &= ~(uint64_t)(MP4_DIRECTIO_ALIGNMENT - 1);
+        spans[n].end_ = ngx_align(spans[n].end_, MP4_DIRECTIO_ALIGNMENT);
       }
-      //MP4_INFO("fragment start %"PRIi64" end %"PRIi64, offset, pos_end);
-      if(!pos_end || offset == 0xFFFFFFFFFFFFFFFFULL) return 0; // sanity check
-      mp4_read(mp4_context, &data, pos_end - offset, offset);
-      if(!data) return 0;
-    }
-
-    int order = -1;
-    while(1) {
-      u_int to_break = 0;
-      for(i = 0; i < fragment_size; ++i) {
-        if(fragment[i].trak == NULL) continue;
-        if(fragment[i].first == fragment[i].last && to_break ==0) to_break = 1;
+      ++n;
+    }
+  }
+  if(n == 0) {
+    ngx_pfree(mp4_context->r->pool, spans);
+    return NULL;
+  }
+
+  ngx_qsort(spans, n, sizeof(mpegts_span_t), mpegts_span_cmp);
+
+  for(i = 1, k = 0; i < n; ++i) {
+    if(spans[i].pos_ <= spans[k].end_ + TS_READ_GAP) {
+      if(spans[i].end_ > spans[k].end_) spans[k].end_ = spans[i].end_;
+    } else spans[++k] = spans[i];
+  }
+  *spans_size = k + 1;
+
+  return spans;
+}
+
+// reads a span, and clears resident if any of it had to come from the disk
+static ssize_t mpegts_read_span(mp4_context_t *mp4_context, u_char *buf, size_t size, off_t pos, ngx_flag_t *resident) {
+#if (NGX_LINUX) && defined(RWF_NOWAIT)
+  if(*resident) {
+    struct iovec iov = { buf, size };
+    ssize_t n = preadv2(mp4_context->file->fd, &iov, 1, pos, RWF_NOWAIT);
+    if(n == (ssize_t)size) {
+      mp4_context->file->offset = pos + n;
+      return n;
+    }
+    *resident = 0;
+    if(n > 0) {
+      ssize_t rest = ngx_read_file(mp4_context->file, buf + n, size - n, pos + n);
+      return rest == NGX_ERROR ? rest : n + rest;
+    }
+  }
+#else
+  *resident = 0;
+#endif
+
+  return ngx_read_file(mp4_context->file, buf, size, pos);
+}
+
+// whether the pages of a mapped span are in memory
+static ngx_flag_t mpegts_span_resident(mp4_context_t *mp4_context, uint64_t pos, uint64_t end) {
+  size_t pages = (end - pos + ngx_pagesize - 1) / ngx_pagesize, i;
+  ngx_flag_t resident = 1;
+
+  unsigned char *vec = ngx_palloc(mp4_context->r->pool, pages);
+  if(vec == NULL) return 0;
+
+  if(mincore(mp4_context->map + pos, end - pos, vec) == -1) resident = 0;
+  else {
+    for(i = 0; i < pages; ++i) {
+      if(!(vec[i] & 1)) {
+        resident = 0;
+        break;
       }
-      if(to_break) break;
-
-      uint64_t min_dts = 0xFFFFFFFFFFFFFFFFULL;
-      int new_order = order;
-      for(i = 0; i < fragment_size; ++i) {
-        if(fragment[i].trak != NULL && fragment[i].first != fragment[i].last) {
-          if(min_dts > fragment[i].first->pts_) {
-            min_dts = fragment[i].first->pts_;
-            new_order = i;
-          }
-        }
+    }
+  }
+
+  ngx_pfree(mp4_context->r->pool, vec);
+  return resident;
+}
+
+// clients fetch the segments in order, so the kernel is asked to read the
+// samples of the next segment while this one is muxed and sent
+static void output_ts_prefetch(mpegts_muxer_t *muxer) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  fragment_t fragment[2];
+  u_int i, n = 0;
+  uint64_t used = 0, size = 0;
+
+  // the last segment has no next one
+  segment_t const *segment = moov_segment(mp4_context->moov, muxer->next_);
+  if(segment == NULL) return;
+
+  ngx_memzero(fragment, sizeof(fragment));
+  u_int fragment_size = output_ts_fragments(mp4_context, muxer->audio_, segment, fragment,
+                                            sizeof(fragment) / sizeof(fragment[0]));
+  if(!fragment_size) return;
+
+  mpegts_span_t *spans = mpegts_spans(mp4_context, fragment, fragment_size, &n, &used);
+  if(spans == NULL) return;
+
+  for(i = 0; i < n; ++i) {
+    if(mp4_context->map) {
+      uint64_t pos = spans[i].pos_ & ~(uint64_t)(ngx_pagesize - 1);
+      madvise(mp4_context->map + pos, spans[i].end_ - pos, MADV_WILLNEED);
+    } else {
+#if (NGX_HAVE_POSIX_FADVISE)
+      posix_fadvise(mp4_context->file->fd, spans[i].pos_, spans[i].end_ - spans[i].pos_, POSIX_FADV_WILLNEED);
+#endif
+    }
+    size += spans[i].end_ - spans[i].pos_;
+  }
+
+  MP4_INFO("prefetch %"PRIu64" bytes in %u spans from sync sample %u", size, n, muxer->next_);
+
+  ngx_pfree(mp4_context->r->pool, spans);
+}
+
+// with hls_read_window, puts the parts of the spans of the segment that are
+// read next into spans_: from the sample every fragment is at, as much as the
+// window holds. A sample larger than its share of the window is read whole.
+// The first window also holds the audio output_ts_seek left in a payload.
+static int output_ts_window(mpegts_muxer_t *muxer, int first) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  fragment_t *fragment = muxer->fragment_;
+  mpegts_span_t const *reads = muxer->reads_;
+  uint64_t low = (uint64_t)-1, high = 0;
+  u_int i, j, k = 0, n = 0;
+  size_t size = 0;
+
+  // room for the parts, and behind them for the ranges they are cut by
+  if(muxer->spans_ == reads) {
+    muxer->spans_ = ngx_palloc(mp4_context->r->pool, sizeof(mpegts_span_t) * (muxer->reads_size_ + 2 * muxer->fragment_size_));
+    if(muxer->spans_ == NULL) return 0;
+  }
+  mpegts_span_t *spans = muxer->spans_, *ranges = spans + muxer->reads_size_ + muxer->fragment_size_;
+
+  for(i = 0; i < muxer->fragment_size_; ++i) {
+    if(fragment[i].trak == NULL || fragment[i].first.sample_ == fragment[i].last) continue;
+    ranges[k].pos_ = sample_cursor_pos(first ? &fragment[i].payload : &fragment[i].first);
+    ranges[k].end_ = sample_cursor_pos(&fragment[i].first) + sample_cursor_size(&fragment[i].first);
+    if(ranges[k].pos_ < low) low = ranges[k].pos_;
+    if(ranges[k].end_ > high) high = ranges[k].end_;
+    ++k;
+  }
+  if(k == 0) return 0;
+
+  // interleaved tracks share the window, others get a part of it each
+  if(high - low <= muxer->window_) {
+    ranges[0].pos_ = low;
+    ranges[0].end_ = low + muxer->window_;
+    k = 1;
+  } else {
+    for(i = 0; i < k; ++i) {
+      if(ranges[i].end_ - ranges[i].pos_ < muxer->window_ / k) ranges[i].end_ = ranges[i].pos_ + muxer->window_ / k;
+    }
+    ngx_qsort(ranges, k, sizeof(mpegts_span_t), mpegts_span_cmp);
+    for(i = 1, j = 0; i < k; ++i) {
+      if(ranges[i].pos_ <= ranges[j].end_) {
+        if(ranges[i].end_ > ranges[j].end_) ranges[j].end_ = ranges[i].end_;
+      } else ranges[++j] = ranges[i];
+    }
+    k = j + 1;
+  }
+
+  for(i = 0, j = 0; i < k; ++i) {
+    u_int r;
+
+    // direct I/O reads whole blocks
+    if(mp4_context->alignment) {
+      ranges[i].pos_ &= ~(uint64_t)(MP4_DIRECTIO_ALIGNMENT - 1);
+      ranges[i].end_ = ngx_align(ranges[i].end_, MP4_DIRECTIO_ALIGNMENT);
+    }
+
+    while(j < muxer->reads_size_ && reads[j].end_ <= ranges[i].pos_) ++j;
+    for(r = j; r < muxer->reads_size_ && reads[r].pos_ < ranges[i].end_; ++r) {
+      spans[n].pos_ = ngx_max(reads[r].pos_, ranges[i].pos_);
+      spans[n].end_ = ngx_min(reads[r].end_, ranges[i].end_);
+      spans[n].offset_ = size;
+      size += spans[n].end_ - spans[n].pos_;
+      ++n;
+    }
+  }
+  muxer->spans_size_ = n;
+
+  // the buffer is kept for the next window, unless that one is larger. It is
+  // no larger than the spans of a segment that is smaller than the window.
+  if(size > muxer->data_size_) {
+    size_t total = 0;
+    for(i = 0; i < muxer->reads_size_; ++i) total += reads[i].end_ - reads[i].pos_;
+
+    if(muxer->data_) ngx_pfree(mp4_context->r->pool, muxer->data_);
+    muxer->data_size_ = ngx_max(size, ngx_min(muxer->window_, total));
+    if(mp4_context->alignment)
+      muxer->data_ = ngx_pmemalign(mp4_context->r->pool, ngx_align(muxer->data_size_, MP4_DIRECTIO_ALIGNMENT), MP4_DIRECTIO_ALIGNMENT);
+    else muxer->data_ = ngx_palloc(mp4_context->r->pool, muxer->data_size_);
+    if(muxer->data_ == NULL) {
+      muxer->data_size_ = 0;
+      return 0;
+    }
+  }
+
+  MP4_INFO("window of %zu bytes in %u reads", size, n);
+
+  return 1;
+}
+
+// finds the spans of the samples of the segment that are still needed and
+// the buffer they go into. A mapped file needs no reads, resident is cleared
+// if its spans are not all in memory.
+static int output_ts_read_begin(mpegts_muxer_t *muxer, ngx_flag_t *resident) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  u_int i, n = 0;
+  size_t size = 0;
+  uint64_t used = 0;
+
+  mpegts_span_t *spans = mpegts_spans(mp4_context, muxer->fragment_, muxer->fragment_size_, &n, &used);
+  if(spans == NULL) return 0;
+
+  muxer->spans_ = spans;
+  muxer->spans_size_ = n;
+
+  // a mapped file is read in place, the kernel is told which parts are next
+  if(mp4_context->map) {
+    for(i = 0; i < n; ++i) {
+      uint64_t pos = spans[i].pos_ & ~(uint64_t)(ngx_pagesize - 1);
+      if(*resident) *resident = mpegts_span_resident(mp4_context, pos, spans[i].end_);
+      madvise(mp4_context->map + pos, spans[i].end_ - pos, MADV_SEQUENTIAL);
+      madvise(mp4_context->map + pos, spans[i].end_ - pos, MADV_WILLNEED);
+      spans[i].offset_ = spans[i].pos_;
+      size += spans[i].end_ - spans[i].pos_;
+    }
+
+    MP4_INFO("mapped %zu bytes in %u spans for %"PRIu64" bytes of samples", size, n, used);
+
+    muxer->data_ = mp4_context->map;
+    return 1;
+  }
+
+  if(muxer->window_) {
+    muxer->reads_ = spans;
+    muxer->reads_size_ = n;
+    return output_ts_window(muxer, 1);
+  }
+
+  for(i = 0; i < n; ++i) {
+    spans[i].offset_ = size;
+    size += spans[i].end_ - spans[i].pos_;
+  }
+
+  if(mp4_context->alignment) muxer->data_ = ngx_pmemalign(mp4_context->r->pool, size, MP4_DIRECTIO_ALIGNMENT);
+  else muxer->data_ = ngx_palloc(mp4_context->r->pool, size);
+  if(muxer->data_ == NULL) return 0;
+
+  MP4_INFO("reading %zu bytes in %u reads for %"PRIu64" bytes of samples", size, n, used);
+
+  return 1;
+}
+
+// whether span i was read whole
+static int output_ts_read_check(mpegts_muxer_t *muxer, u_int i, ssize_t bytes) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  mpegts_span_t const *span = &muxer->spans_[i];
+  size_t span_size = span->end_ - span->pos_;
+
+  // the last block of the file ends short
+  if(span->end_ > (uint64_t)mp4_context->filesize) span_size = mp4_context->filesize - span->pos_;
+  if(bytes < (ssize_t)span_size) {
+    MP4_ERROR("read only %zd of %zu from \"%s\"", bytes, span_size, mp4_context->file->name.data);
+    return 0;
+  }
+
+  return 1;
+}
+
+// the muxer can go on once the samples are read. resident is -1 if it is not
+// known whether they were in memory.
+static void output_ts_read_end(mpegts_muxer_t *muxer, ngx_int_t resident) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_streaming_module);
+  u_int i;
+
+  for(i = 0; i < muxer->fragment_size_; ++i) {
+    if(muxer->fragment_[i].trak == NULL) continue;
+    if(muxer->fragment_[i].stream->payload_index_) fragment_refill(muxer, &muxer->fragment_[i]);
+  }
+
+  // direct I/O does not go through the page cache the prefetch fills
+  if(conf->prefetch && !mp4_context->alignment) {
+    hls_main_conf_t *hmcf = ngx_http_get_module_main_conf(mp4_context->r, ngx_http_streaming_module);
+    if(resident != -1) hls_cache_count(hmcf->prefetch, resident);
+    output_ts_prefetch(muxer);
+  }
+}
+
+// reads the samples of the segment that are still needed
+static int output_ts_read(mpegts_muxer_t *muxer) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(mp4_context->r, ngx_http_streaming_module);
+  ngx_flag_t resident = conf->prefetch && !mp4_context->alignment;
+  u_int i;
+
+  if(!output_ts_read_begin(muxer, &resident)) return 0;
+
+  if(muxer->data_ != mp4_context->map) {
+    for(i = 0; i < muxer->spans_size_; ++i) {
+      mpegts_span_t const *span = &muxer->spans_[i];
+      ssize_t bytes = mpegts_read_span(mp4_context, muxer->data_ + span->offset_, span->end_ - span->pos_, span->pos_, &resident);
+      if(!output_ts_read_check(muxer, i, bytes)) return 0;
+    }
+  }
+
+  output_ts_read_end(muxer, resident);
+
+  return 1;
+}
+
+#if (NGX_HLS_IO_URING)
+// the reads of output_ts_read for the io_uring, or NULL if a mapped file
+// needs none. Once they are done output_ts_read_done finishes them.
+static hls_uring_io_t *output_ts_read_io(mpegts_muxer_t *muxer, ngx_int_t *rc) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  ngx_flag_t resident = 0;
+  u_int i;
+
+  *rc = NGX_ERROR;
+  // all of the samples go to the ring in one submission
+  muxer->window_ = 0;
+  if(!output_ts_read_begin(muxer, &resident)) return NULL;
+
+  *rc = NGX_OK;
+  if(muxer->data_ == mp4_context->map) {
+    output_ts_read_end(muxer, -1);
+    return NULL;
+  }
+
+  hls_uring_io_t *io = ngx_pcalloc(mp4_context->r->pool, sizeof(hls_uring_io_t));
+  if(io == NULL) goto failed;
+
+  io->reads = ngx_pcalloc(mp4_context->r->pool, sizeof(hls_uring_read_t) * muxer->spans_size_);
+  if(io->reads == NULL) goto failed;
+
+  io->fd = mp4_context->file->fd;
+  io->nreads = muxer->spans_size_;
+  io->log = mp4_context->file->log;
+  for(i = 0; i < muxer->spans_size_; ++i) {
+    mpegts_span_t const *span = &muxer->spans_[i];
+    io->reads[i].buf = muxer->data_ + span->offset_;
+    io->reads[i].size = span->end_ - span->pos_;
+    io->reads[i].pos = span->pos_;
+  }
+
+  return io;
+
+failed:
+  *rc = NGX_ERROR;
+  return NULL;
+}
+
+static int output_ts_read_done(mpegts_muxer_t *muxer, hls_uring_io_t *io) {
+  u_int i;
+
+  for(i = 0; i < io->nreads; ++i) {
+    if(!output_ts_read_check(muxer, i, io->reads[i].bytes)) return 0;
+  }
+
+  output_ts_read_end(muxer, -1);
+
+  return 1;
+}
+#endif
+
+// reads the next window of hls_read_window
+static int output_ts_window_read(mpegts_muxer_t *muxer) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  ngx_flag_t resident = 0;
+  u_int i;
+
+  if(!output_ts_window(muxer, 0)) return 0;
+
+  for(i = 0; i < muxer->spans_size_; ++i) {
+    mpegts_span_t const *span = &muxer->spans_[i];
+    ssize_t bytes = mpegts_read_span(mp4_context, muxer->data_ + span->offset_, span->end_ - span->pos_, span->pos_, &resident);
+    if(!output_ts_read_check(muxer, i, bytes)) return 0;
+  }
+
+  return 1;
+}
+
+// the data of a sample, which moves the window of hls_read_window on if the
+// sample is not in it. NULL if it can't be read.
+static unsigned char const *mpegts_muxer_sample(mpegts_muxer_t *muxer, uint64_t pos, u_int size) {
+  if(muxer->window_) {
+    mpegts_span_t const *span = &muxer->spans_[mpegts_muxer_span(muxer, pos)];
+    if((pos < span->pos_ || pos + size > span->end_) && !output_ts_window_read(muxer)) return NULL;
+  }
+
+  return mpegts_muxer_data(muxer, pos);
+}
+
+// muxes the next sample. Returns 0 once the segment is written, -1 if the
+// sample can't be read.
+static int mpegts_muxer_next(mpegts_muxer_t *muxer) {
+  uint32_t mark_video = FOURCC('v', 'i', 'd', 'e'), mark_sound = FOURCC('s', 'o', 'u', 'n');
+  fragment_t *fragment = muxer->fragment_;
+  u_int fragment_size = muxer->fragment_size_, i;
+  int order = muxer->order_;
+
+  for(i = 0; i < fragment_size; ++i) {
+    if(fragment[i].trak == NULL) continue;
+    if(fragment[i].first.sample_ == fragment[i].last) return 0;
+  }
+
+  uint64_t min_dts = 0xFFFFFFFFFFFFFFFFULL;
+  int new_order = order;
+  for(i = 0; i < fragment_size; ++i) {
+    if(fragment[i].trak != NULL && fragment[i].first.sample_ != fragment[i].last) {
+      if(min_dts > fragment[i].dts) {
+        min_dts = fragment[i].dts;
+        new_order = i;
       }
-      if(order != -1 && order != new_order && fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_sound)
-        flush_audio_packet(fragment[order].stream, muxer->bucket_);
-      order = new_order;
-      if(order == -1) break;
-      if(order > (int)max_fragment_size) break;
+    }
+  }
+  if(order != -1 && order != new_order && fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_sound)
+    flush_audio_packet(fragment[order].stream, muxer->bucket_);
+  order = new_order;
+  muxer->order_ = order;
+  if(order == -1 || order > (int)fragment_size) return 0;
 
-      uint64_t dts0 = fragment[order].first->pts_;
-      uint64_t pts = fragment[order].first->pts_ + fragment[order].first->cto_;
+  uint64_t dts0 = fragment[order].dts;
+  uint64_t pts = fragment[order].pts;
 
-      uint64_t sample_pos = fragment[order].first->pos_;
-      u_int sample_size = fragment[order].first->size_;
+  uint64_t sample_pos = sample_cursor_pos(&fragment[order].first);
+  u_int sample_size = sample_cursor_size(&fragment[order].first);
 
 #ifdef _DEBUG
-      MP4_INFO("track=%d dts=%"PRIi64" pts=%"PRIi64" data=%"PRIu64":%u\n", order, dts0, pts, sample_pos + sample_size, sample_size);
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  MP4_INFO("track=%d dts=%"PRIi64" pts=%"PRIi64" data=%"PRIu64":%u\n", order, dts0, pts, sample_pos + sample_size, sample_size);
 #endif
 
-      unsigned char *data_local = data + (sample_pos - offset);
+  // counting the bytes needs only the sample sizes
+  unsigned char const *sample = NULL;
+  if(!muxer->size_only_) {
+    sample = mpegts_muxer_sample(muxer, sample_pos, sample_size);
+    if(sample == NULL) return -1;
+  }
 
-      if(fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_sound) {
-        if(fragment[order].stream->payload_dts_ == NOPTS_VALUE) {
-          fragment[order].stream->payload_dts_ = dts0;
-          fragment[order].stream->payload_pts_ = pts;
-        }
+  if(fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_sound) {
+    if(fragment[order].stream->payload_dts_ == NOPTS_VALUE) {
+      fragment[order].stream->payload_dts_ = dts0;
+      fragment[order].stream->payload_pts_ = pts;
+    }
+
+    uint8_t adts[7];
+    sample_entry_get_adts(&fragment[order].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0], sample_size, adts);
+    write_audio_packet(fragment[order].stream, muxer->bucket_, NOPTS_VALUE, NOPTS_VALUE, adts, 7);
+
+    write_audio_packet(fragment[order].stream, muxer->bucket_, dts0, pts, sample, sample_size);
+
+    if(fragment[order].first.sample_ + 1 == fragment[order].last) flush_audio_packet(fragment[order].stream, muxer->bucket_);
+  } else if(fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_video)
+    write_video_packet(fragment[order].stream, muxer->bucket_, dts0, pts, sample, sample_size);
+
+  fragment_next(&fragment[order]);
+
+  return 1;
+}
+
+// muxes samples until at least size more bytes are in the bucket. Returns 1
+// once the whole segment is written, NGX_ERROR if samples can't be read.
+static int output_ts_mux(mpegts_muxer_t *muxer, uint64_t size) {
+  uint64_t content_length = muxer->bucket_->content_length;
+
+  while(muxer->bucket_->content_length - content_length < size) {
+    int rc = mpegts_muxer_next(muxer);
+    if(rc <= 0) return rc == 0 ? 1 : NGX_ERROR;
+  }
+
+  return 0;
+}
+
+// puts the muxer back to the first samples of the segment
+static void output_ts_rewind(mpegts_muxer_t *muxer) {
+  u_int i;
+  for(i = 0; i < muxer->fragment_size_; ++i) {
+    fragment_t *fragment = &muxer->fragment_[i];
+    if(fragment->trak == NULL) continue;
+    fragment->first = fragment->start;
+    fragment_time(fragment);
+
+    fragment->stream->cc_ = 0;
+    fragment->stream->payload_index_ = 0;
+    fragment->stream->payload_dts_ = NOPTS_VALUE;
+    fragment->stream->payload_pts_ = NOPTS_VALUE;
+    fragment->stream->packets_ = 0;
+  }
+
+  muxer->next_pat_ = NOPTS_VALUE;
+  muxer->pat_cc_ = 0;
+  muxer->pmt_cc_ = 0;
+  muxer->order_ = -1;
+}
+
+// the exact size of the segment, for a Content-Length before it is muxed. It
+// runs the muxer on the sample sizes alone, so nothing is read, and rewinds it.
+static uint64_t output_ts_size(mpegts_muxer_t *muxer) {
+  bucket_t *bucket = muxer->bucket_;
+  bucket_t count;
+
+  ngx_memzero(&count, sizeof(bucket_t));
+  muxer->bucket_ = &count;
+  muxer->size_only_ = 1;
+
+  output_ts_mux(muxer, (uint64_t)-1);
+
+  muxer->bucket_ = bucket;
+  muxer->size_only_ = 0;
+  output_ts_rewind(muxer);
 
-        uint8_t adts[7];
-        sample_entry_get_adts(&fragment[order].trak->mdia_->minf_->stbl_->stsd_->sample_entries_[0], sample_size, adts);
-        write_audio_packet(fragment[order].stream, muxer->bucket_, NOPTS_VALUE, NOPTS_VALUE, adts, adts + 7);
+  return count.content_length;
+}
+
+// what output_ts_seek keeps of a fragment to step back a sample
+struct fragment_state_t {
+  sample_cursor_t first;
+  uint64_t dts;
+  uint64_t pts;
+  int cc;
+  int payload_index;
+  uint64_t payload_dts;
+  uint64_t payload_pts;
+  u_int packets;
+};
+typedef struct fragment_state_t fragment_state_t;
+
+static void fragment_save(fragment_t const *fragment, fragment_state_t *state) {
+  state->first = fragment->first;
+  state->dts = fragment->dts;
+  state->pts = fragment->pts;
+  state->cc = fragment->stream->cc_;
+  state->payload_index = fragment->stream->payload_index_;
+  state->payload_dts = fragment->stream->payload_dts_;
+  state->payload_pts = fragment->stream->payload_pts_;
+  state->packets = fragment->stream->packets_;
+}
+
+static void fragment_restore(fragment_t *fragment, fragment_state_t const *state) {
+  fragment->first = state->first;
+  fragment->dts = state->dts;
+  fragment->pts = state->pts;
+  fragment->stream->cc_ = state->cc;
+  fragment->stream->payload_index_ = state->payload_index;
+  fragment->stream->payload_dts_ = state->payload_dts;
+  fragment->stream->payload_pts_ = state->payload_pts;
+  fragment->stream->packets_ = state->packets;
+}
+
+// moves the muxer of a rewound segment to the sample whose packets hold byte
+// offset, so a range is muxed without the samples before it. The continuity
+// counters, PAT and first packet flags are counted on the sample sizes up to
+// there, and output_ts_read then reads from the first sample still needed.
+// The bucket counts on from the first byte the muxer writes next.
+static int output_ts_seek(mpegts_muxer_t *muxer, uint64_t offset) {
+  mp4_context_t *mp4_context = muxer->mp4_context_;
+  fragment_t *fragment = muxer->fragment_;
+  bucket_t *bucket = muxer->bucket_;
+  bucket_t count;
+  u_int i;
+
+  fragment_state_t *state = ngx_palloc(mp4_context->r->pool, sizeof(fragment_state_t) * muxer->fragment_size_);
+  if(state == NULL) return 0;
 
-        write_audio_packet(fragment[order].stream, muxer->bucket_, dts0, pts, data_local, data_local + sample_size);
+  ngx_memzero(&count, sizeof(bucket_t));
+  muxer->bucket_ = &count;
+  muxer->size_only_ = 1;
 
-        if(fragment[order].first + 1 == fragment[order].last) flush_audio_packet(fragment[order].stream, muxer->bucket_);
-      } else if(fragment[order].trak->mdia_->hdlr_->handler_type_ == mark_video)
-        write_video_packet(fragment[order].stream, muxer->bucket_, dts0, pts, data_local, data_local + sample_size);
+  for(;;) {
+    uint64_t next_pat = muxer->next_pat_, content_length = count.content_length;
+    int pat_cc = muxer->pat_cc_, pmt_cc = muxer->pmt_cc_, order = muxer->order_;
 
-      ++fragment[order].first;
+    for(i = 0; i < muxer->fragment_size_; ++i) {
+      if(fragment[i].trak != NULL) fragment_save(&fragment[i], &state[i]);
     }
 
-    for(i = 0; i < fragment_size; ++i) {
-      ngx_pfree(mp4_context->r->pool, data);
+    if(mpegts_muxer_next(muxer) <= 0) break;
+    if(count.content_length <= offset) continue;
+
+    // this sample writes the byte at offset, so the muxer starts with it
+    for(i = 0; i < muxer->fragment_size_; ++i) {
+      if(fragment[i].trak != NULL) fragment_restore(&fragment[i], &state[i]);
     }
+    muxer->next_pat_ = next_pat;
+    muxer->pat_cc_ = pat_cc;
+    muxer->pmt_cc_ = pmt_cc;
+    muxer->order_ = order;
+    count.content_length = content_length;
+    break;
+  }
 
-    mpegts_muxer_exit(mp4_context, muxer);
+  muxer->bucket_ = bucket;
+  muxer->size_only_ = 0;
+  bucket->content_length = count.content_length;
+  ngx_pfree(mp4_context->r->pool, state);
+
+  // the samples of an audio payload that is not written yet are read too
+  for(i = 0; i < muxer->fragment_size_; ++i) {
+    if(fragment[i].trak == NULL) continue;
+    fragment[i].payload = fragment[i].first;
+    fragment[i].payload_skip = 0;
+
+    int index = fragment[i].stream->payload_index_;
+    if(index) {
+      uint64_t fed = 0;
+      sample_cursor_t cursor;
+      for(cursor = fragment[i].start; cursor.sample_ != fragment[i].first.sample_; sample_cursor_next(&cursor))
+        fed += 7 + sample_cursor_size(&cursor);
+
+      fed -= index;
+      for(cursor = fragment[i].start; fed >= 7 + sample_cursor_size(&cursor); sample_cursor_next(&cursor))
+        fed -= 7 + sample_cursor_size(&cursor);
+      fragment[i].payload = cursor;
+      fragment[i].payload_skip = fed;
+    }
   }
 
   return 1;
 }
 
+static void output_ts_close(struct mp4_context_t *mp4_context, mpegts_muxer_t *muxer) {
+  if(muxer->data_ && muxer->data_ != mp4_context->map) ngx_pfree(mp4_context->r->pool, muxer->data_);
+  if(muxer->spans_) ngx_pfree(mp4_context->r->pool, muxer->spans_);
+  if(muxer->reads_ && muxer->reads_ != muxer->spans_) ngx_pfree(mp4_context->r->pool, muxer->reads_);
+  mpegts_muxer_exit(mp4_context, muxer);
+}
+
+int output_ts(struct mp4_context_t *mp4_context, struct bucket_t *bucket, struct mp4_split_options_t const *options) {
+  mpegts_muxer_t *muxer = output_ts_open(mp4_context, bucket, options);
+  if(muxer == NULL) return 0;
+
+  if(!output_ts_read(muxer)) {
+    output_ts_close(mp4_context, muxer);
+    return 0;
+  }
+
+  int rc = output_ts_mux(muxer, (uint64_t)-1);
+  output_ts_close(mp4_context, muxer);
+  if(rc == NGX_ERROR) return 0;
+
+  return 1;
+}
+
+// segments are cached by file, segment, audio track and length.
+static int ts_cache_read(ngx_http_request_t *r, ngx_str_t *key, ngx_file_t const *file,
+                         ngx_open_file_info_t const *of, mp4_split_options_t const *options, bucket_t *bucket) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  u_int audio = options->fragment_track_id ? options->fragment_track_id : 1;
+  ngx_str_t extra;
+  u_char buf[3 * (NGX_INT64_LEN + 1)];
+
+  if(conf->segment_cache == NULL) return 0;
+
+  extra.data = buf;
+  extra.len = ngx_sprintf(buf, "%uL:%ui:%ui", options->fragment_start, (ngx_uint_t)audio, conf->length) - buf;
+  if(!hls_cache_key(r, key, 's', &file->name, of, &extra)) return 0;
+
+  hls_cache_node_t *node = hls_cache_lookup(r, conf->segment_cache, key);
+  if(node == NULL) return 0;
+
+  bucket_insert_ref(bucket, node->data, node->size);
+
+  return 1;
+}
+
+static ngx_int_t ts_cache_write(ngx_http_request_t *r, ngx_str_t *key, bucket_t *bucket) {
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+
+  return hls_cache_insert_chain(conf->segment_cache, key, bucket->first, bucket->content_length);
+}
+
 // End Of File
@@ -0,0 +1,174 @@
+// Times decoding the sample tables: the byte-swap of stsz, the prefix sum of
+// the sample offsets, and the whole trak_build_index of a synthetic trak with
+// stsz, stco, stsc, stts, ctts and stss tables. Usage: bench [samples]
+#include "ngx_http_streaming_module.c"
+#include <time.h>
+
+#define BENCH_CHUNK 12  // samples per chunk
+#define BENCH_GOP 48    // samples per sync sample
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void bench_read(unsigned char const *buffer, unsigned int n) {
+  uint32_t *dst = malloc(n * sizeof(uint32_t));
+  double best = 1e9;
+  int k;
+
+  for(k = 0; k != 20; ++k) {
+    double t = bench_now();
+    read_32_array(dst, buffer, n);
+    t = bench_now() - t;
+    if(t < best) best = t;
+  }
+  printf("  stsz %8.3f ms %6.2f GB/s\n", best * 1e3, 4.0 * n / best / 1e9);
+  free(dst);
+}
+
+static void bench_sum(uint32_t const *src, unsigned int n) {
+  uint32_t *dst = malloc(n * sizeof(uint32_t));
+  double best = 1e9;
+  int k;
+
+  for(k = 0; k != 20; ++k) {
+    double t = bench_now();
+    sum_32_array(dst, src, n);
+    t = bench_now() - t;
+    if(t < best) best = t;
+  }
+  printf("  sum  %8.3f ms\n", best * 1e3);
+  free(dst);
+}
+
+static void bench_kernels(unsigned char const *stsz, unsigned int n) {
+  uint32_t *sizes = malloc(n * sizeof(uint32_t));
+
+  printf("%u entries:\n", n);
+  bench_read(stsz, n);
+  read_32_array(sizes, stsz, n);
+  bench_sum(sizes, n);
+  free(sizes);
+}
+
+struct bench_tables_t {
+  unsigned char *stsz, *stco, *stsc, *stts, *ctts, *stss;
+  size_t stsz_size, stco_size, stsc_size, stts_size, ctts_size, stss_size;
+};
+
+// the tables of a 23.976 fps video trak, without their atom headers
+static void bench_tables(struct bench_tables_t *tables, unsigned int n) {
+  unsigned int chunks = (n + BENCH_CHUNK - 1) / BENCH_CHUNK, syncs = (n + BENCH_GOP - 1) / BENCH_GOP, i;
+  unsigned char *p;
+
+  tables->stsz_size = 12 + 4 * (size_t)n;
+  p = tables->stsz = malloc(tables->stsz_size);
+  p = write_32(p, 0);
+  p = write_32(p, 0);
+  p = write_32(p, n);
+  for(i = 0; i != n; ++i) p = write_32(p, i % BENCH_GOP ? 100 + rand() % 9000 : 30000 + rand() % 30000);
+
+  tables->stco_size = 8 + 4 * (size_t)chunks;
+  p = tables->stco = malloc(tables->stco_size);
+  p = write_32(p, 0);
+  p = write_32(p, chunks);
+  for(i = 0; i != chunks; ++i) p = write_32(p, 1000 + i * 200000);
+
+  tables->stsc_size = 20;
+  p = tables->stsc = malloc(tables->stsc_size);
+  p = write_32(p, 0);
+  p = write_32(p, 1);
+  p = write_32(p, 1);
+  p = write_32(p, BENCH_CHUNK);
+  p = write_32(p, 1);
+
+  tables->stts_size = 16;
+  p = tables->stts = malloc(tables->stts_size);
+  p = write_32(p, 0);
+  p = write_32(p, 1);
+  p = write_32(p, n);
+  p = write_32(p, 1001);
+
+  // a B-frame pattern, one run per sample
+  tables->ctts_size = 8 + 8 * (size_t)n;
+  p = tables->ctts = malloc(tables->ctts_size);
+  p = write_32(p, 0);
+  p = write_32(p, n);
+  for(i = 0; i != n; ++i) {
+    p = write_32(p, 1);
+    p = write_32(p, (i % 3) * 1001);
+  }
+
+  tables->stss_size = 8 + 4 * (size_t)syncs;
+  p = tables->stss = malloc(tables->stss_size);
+  p = write_32(p, 0);
+  p = write_32(p, syncs);
+  for(i = 0; i != syncs; ++i) p = write_32(p, 1 + i * BENCH_GOP);
+}
+
+static double bench_index(mp4_context_t *mp4_context, struct bench_tables_t const *tables, int with_ctts) {
+  double t = bench_now();
+  trak_t *trak = trak_init();
+
+  trak->mdia_ = mdia_init();
+  trak->mdia_->mdhd_ = mdhd_init();
+  trak->mdia_->mdhd_->timescale_ = 24000;
+  trak->mdia_->hdlr_ = hdlr_init();
+  trak->mdia_->hdlr_->handler_type_ = FOURCC('v', 'i', 'd', 'e');
+  trak->mdia_->minf_ = minf_init();
+
+  stbl_t *stbl = trak->mdia_->minf_->stbl_ = stbl_init();
+  stbl->stsz_ = stsz_read(mp4_context, NULL, tables->stsz, tables->stsz_size);
+  stbl->stco_ = stco_read(mp4_context, NULL, tables->stco, tables->stco_size);
+  stbl->stsc_ = stsc_read(mp4_context, NULL, tables->stsc, tables->stsc_size);
+  stbl->stts_ = stts_read(mp4_context, NULL, tables->stts, tables->stts_size);
+  stbl->stss_ = stss_read(mp4_context, NULL, tables->stss, tables->stss_size);
+  if(with_ctts) stbl->ctts_ = ctts_read(mp4_context, NULL, tables->ctts, tables->ctts_size);
+
+  if(!trak_build_index(mp4_context, trak)) {
+    fprintf(stderr, "trak_build_index failed\n");
+    exit(1);
+  }
+  t = bench_now() - t;
+
+  trak_exit(trak);
+  return t;
+}
+
+int main(int argc, char **argv) {
+  unsigned int n = argc > 1 ? (unsigned int)atoi(argv[1]) : 2400000;
+  static ngx_log_t log;
+  static ngx_connection_t connection;
+  static ngx_http_request_t r;
+  mp4_context_t mp4_context;
+  struct bench_tables_t tables;
+  int with_ctts, k;
+
+  srand(1);
+  bench_tables(&tables, n);
+
+  // in cache, and as large as a long film
+  bench_kernels(tables.stsz + 12, n < 65536 ? n : 65536);
+  if(n > 65536) bench_kernels(tables.stsz + 12, n);
+
+  connection.log = &log;
+  r.connection = &connection;
+  ngx_memzero(&mp4_context, sizeof(mp4_context_t));
+  mp4_context.r = &r;
+
+  printf("trak_build_index, %u samples:\n", n);
+  for(with_ctts = 0; with_ctts != 2; ++with_ctts) {
+    double best = 1e9;
+    for(k = 0; k != 7; ++k) {
+      double t = bench_index(&mp4_context, &tables, with_ctts);
+      if(t < best) best = t;
+    }
+    printf("  %-10s %8.2f ms %6.2f ns/sample\n", with_ctts ? "with ctts" : "plain", best * 1e3, best * 1e9 / n);
+  }
+
+  return 0;
+}
+
+// End Of File
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Generate a synthetic H.264/AAC MP4 for the tests (payloads are random)."""
+import random, struct, sys
+
+def box(t, *payload):
+    data = b''.join(payload)
+    return struct.pack('>I', 8 + len(data)) + t + data
+
+def full(t, ver, flags, *payload):
+    return box(t, struct.pack('>I', (ver << 24) | flags), *payload)
+
+def build(seconds=120, audio_tracks=1, moov_first=True, seed=1, fps_num=24000, fps_den=1001, gop=48, chunk_v=12, chunk_a=22, co64=False, first_key=0):
+    rnd = random.Random(seed)
+    vts = fps_num
+    nv = int(seconds * fps_num / fps_den)
+    vsamples = []
+    for i in range(nv):
+        key = i >= first_key and (i - first_key) % gop == 0
+        nals = []
+        if key:
+            nals.append(bytes([0x65]) + bytes(rnd.getrandbits(8) for _ in range(rnd.randint(3000, 9000))))
+        else:
+            nals.append(bytes([0x41]) + bytes(rnd.getrandbits(8) for _ in range(rnd.randint(100, 2500))))
+        if rnd.random() < 0.2:
+            nals.append(bytes([0x06]) + bytes(rnd.getrandbits(8) for _ in range(rnd.randint(5, 40))))
+        data = b''.join(struct.pack('>I', len(n)) + n for n in nals)
+        vsamples.append((data, key))
+    ats = 44100
+    na = int(seconds * ats / 1024)
+    asamples = []
+    for t in range(audio_tracks):
+        asamples.append([bytes(rnd.getrandbits(8) for _ in range(rnd.randint(150, 450))) for _ in range(na)])
+
+    # interleave chunks
+    tracks = [('v', vsamples, chunk_v, vts, fps_den)] + [('a', a, chunk_a, ats, 1024) for a in asamples]
+    chunks = [[] for _ in tracks]     # list of (offset placeholder index, first sample, count)
+    order = []
+    pos = [0] * len(tracks)
+    while any(pos[i] < len(tr[1]) for i, tr in enumerate(tracks)):
+        # pick track with lowest time
+        best = None
+        for i, tr in enumerate(tracks):
+            if pos[i] >= len(tr[1]):
+                continue
+            tm = pos[i] * tr[4] / tr[3]
+            if best is None or tm < best[0]:
+                best = (tm, i)
+        i = best[1]
+        n = min(tracks[i][2], len(tracks[i][1]) - pos[i])
+        order.append((i, pos[i], n))
+        pos[i] += n
+
+    def make_moov(mdat_start):
+        offs = [[] for _ in tracks]
+        o = mdat_start + 8
+        for (i, first, n) in order:
+            offs[i].append(o)
+            for k in range(first, first + n):
+                s = tracks[i][1][k]
+                o += len(s[0]) if isinstance(s, tuple) else len(s)
+        traks = []
+        for i, tr in enumerate(tracks):
+            kind, samples, _, ts, dur = tr
+            sizes = [len(s[0]) if isinstance(s, tuple) else len(s) for s in samples]
+            counts = [n for (j, f, n) in order if j == i]
+            stsc_entries = []
+            for ci, n in enumerate(counts):
+                if not stsc_entries or stsc_entries[-1][1] != n:
+                    stsc_entries.append((ci + 1, n, 1))
+            stsc = full(b'stsc', 0, 0, struct.pack('>I', len(stsc_entries)), b''.join(struct.pack('>III', *e) for e in stsc_entries))
+            stsz = full(b'stsz', 0, 0, struct.pack('>II', 0, len(sizes)), b''.join(struct.pack('>I', s) for s in sizes))
+            if co64:
+                stco = full(b'co64', 0, 0, struct.pack('>I', len(offs[i])), b''.join(struct.pack('>Q', x) for x in offs[i]))
+            else:
+                stco = full(b'stco', 0, 0, struct.pack('>I', len(offs[i])), b''.join(struct.pack('>I', x) for x in offs[i]))
+            stts = full(b'stts', 0, 0, struct.pack('>III', 1, len(samples), dur))
+            extra = b''
+            if kind == 'v':
+                sps = bytes([0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb, 0x01, 0x10])
+                pps = bytes([0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0])
+                avcc = box(b'avcC', bytes([1, 0x64, 0, 0x1f, 0xff, 0xe1]), struct.pack('>H', len(sps)), sps, bytes([1]), struct.pack('>H', len(pps)), pps)
+                entry = box(b'avc1', bytes(6), struct.pack('>H', 1), bytes(16), struct.pack('>HH', 1280, 720), struct.pack('>II', 0x480000, 0x480000), bytes(4), struct.pack('>H', 1), bytes(32), struct.pack('>Hh', 24, -1), avcc)
+                stsd = full(b'stsd', 0, 0, struct.pack('>I', 1), entry)
+                keys = [k + 1 for k, s in enumerate(samples) if s[1]]
+                stss = full(b'stss', 0, 0, struct.pack('>I', len(keys)), b''.join(struct.pack('>I', k) for k in keys))
+                # ctts: B-frame style pattern
+                runs = []
+                for k in range(len(samples)):
+                    off = [2, 0, 1][k % 3] * dur if k % gop else dur
+                    if runs and runs[-1][1] == off:
+                        runs[-1][0] += 1
+                    else:
+                        runs.append([1, off])
+                ctts = full(b'ctts', 0, 0, struct.pack('>I', len(runs)), b''.join(struct.pack('>II', *r) for r in runs))
+                extra = stss + ctts
+                hdlr = full(b'hdlr', 0, 0, struct.pack('>I', 0), b'vide', bytes(12), b'VideoHandler\x00')
+                mhd = full(b'vmhd', 0, 1, bytes(8))
+            else:
+                esds = full(b'esds', 0, 0, bytes([3, 25, 0, 1, 0, 4, 17, 0x40, 0x15]) + struct.pack('>BHII', 0, 0, 128000, 128000)[1:] + bytes([5, 2, 0x12, 0x10, 6, 1, 2]))
+                entry = box(b'mp4a', bytes(6), struct.pack('>H', 1), bytes(8), struct.pack('>HHHH', 2, 16, 0, 0), struct.pack('>HH', ts, 0), esds)
+                stsd = full(b'stsd', 0, 0, struct.pack('>I', 1), entry)
+                hdlr = full(b'hdlr', 0, 0, struct.pack('>I', 0), b'soun', bytes(12), b'SoundHandler\x00')
+                mhd = full(b'smhd', 0, 0, bytes(4))
+            stbl = box(b'stbl', stsd, stts, stsc, stsz, stco, extra)
+            dinf = box(b'dinf', full(b'dref', 0, 0, struct.pack('>I', 1), full(b'url ', 0, 1)))
+            minf = box(b'minf', mhd, dinf, stbl)
+            mdhd = full(b'mdhd', 0, 0, struct.pack('>IIII', 0, 0, ts, len(samples) * dur), struct.pack('>HH', 0x55c4, 0))
+            mdia = box(b'mdia', mdhd, hdlr, minf)
+            tkhd = full(b'tkhd', 0, 7, struct.pack('>IIIII', 0, 0, i + 1, 0, 0), bytes(8), struct.pack('>HHHH', 0, 0, 0x100 if kind == 'a' else 0, 0), struct.pack('>9I', 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000), struct.pack('>II', 1280 << 16 if kind == 'v' else 0, 720 << 16 if kind == 'v' else 0))
+            traks.append(box(b'trak', tkhd, mdia))
+        mvhd = full(b'mvhd', 0, 0, struct.pack('>IIII', 0, 0, 1000, seconds * 1000), struct.pack('>IH', 0x10000, 0x100), bytes(10), struct.pack('>9I', 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000), bytes(24), struct.pack('>I', len(tracks) + 1))
+        return box(b'moov', mvhd, *traks)
+
+    payload = b''.join((lambda s: s[0] if isinstance(s, tuple) else s)(tracks[i][1][k]) for (i, f, n) in order for k in range(f, f + n))
+    ftyp = box(b'ftyp', b'isom', struct.pack('>I', 512), b'isomiso2avc1mp41')
+    free = box(b'free', bytes(100))
+    if moov_first:
+        moov_len = len(make_moov(0))
+        mdat_start = len(ftyp) + moov_len + len(free)
+        moov = make_moov(mdat_start)
+        assert len(moov) == moov_len
+        return ftyp + moov + free + struct.pack('>I', 8 + len(payload)) + b'mdat' + payload
+    else:
+        mdat_start = len(ftyp) + len(free)
+        moov = make_moov(mdat_start)
+        return ftyp + free + struct.pack('>I', 8 + len(payload)) + b'mdat' + payload + moov
+
+if __name__ == '__main__':
+    out = sys.argv[1]
+    kw = {}
+    for a in sys.argv[2:]:
+        k, v = a.split('=')
+        kw[k] = (v == 'True') if v in ('True', 'False') else int(v)
+    open(out, 'wb').write(build(**kw))
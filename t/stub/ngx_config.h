@@ -0,0 +1 @@
+#include "ngx_core.h"
@@ -0,0 +1,438 @@
+/* Minimal nginx API stub to build and run the tests of the hls module without nginx. */
+#ifndef NGX_STUB_CORE_H
+#define NGX_STUB_CORE_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#define NGX_LINUX 1
+#define NGX_HAVE_POSIX_FADVISE 1
+#define NGX_HAVE_FILE_AIO 0
+#ifndef NGX_THREADS
+#define NGX_THREADS 1
+#endif
+#define NGX_HAVE_O_DIRECT 1
+
+typedef intptr_t ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+typedef intptr_t ngx_flag_t;
+typedef unsigned char u_char;
+typedef int ngx_fd_t;
+typedef int ngx_err_t;
+typedef time_t ngx_msec_int_t;
+typedef ngx_uint_t ngx_msec_t;
+typedef ngx_uint_t ngx_rbtree_key_t;
+typedef ngx_int_t ngx_rbtree_key_int_t;
+typedef struct stat ngx_file_info_t;
+typedef ino_t ngx_file_uniq_t;
+typedef volatile ngx_uint_t ngx_atomic_t;
+typedef ngx_uint_t ngx_atomic_uint_t;
+typedef ngx_int_t ngx_atomic_int_t;
+typedef pid_t ngx_pid_t;
+
+#define NGX_OK 0
+#define NGX_ERROR -1
+#define NGX_AGAIN -2
+#define NGX_BUSY -3
+#define NGX_DONE -4
+#define NGX_DECLINED -5
+#define NGX_ABORT -6
+#define NGX_FILE_ERROR -1
+#define NGX_INVALID_FILE -1
+#define NGX_ENOENT ENOENT
+#define NGX_ENOTDIR ENOTDIR
+#define NGX_ENAMETOOLONG ENAMETOOLONG
+#define NGX_EACCES EACCES
+#define NGX_MAX_OFF_T_VALUE 9223372036854775807LL
+#define NGX_OPEN_FILE_DIRECTIO_OFF NGX_MAX_OFF_T_VALUE
+#define NGX_MAX_SIZE_T_VALUE 9223372036854775807LL
+#define NGX_CONF_UNSET -1
+#define NGX_CONF_UNSET_UINT (ngx_uint_t) -1
+#define NGX_CONF_UNSET_SIZE (size_t) -1
+#define NGX_CONF_UNSET_MSEC (ngx_msec_t) -1
+#define NGX_CONF_UNSET_PTR (void *) -1
+#define NGX_CONF_OK NULL
+#define NGX_CONF_ERROR (void *) -1
+#define NGX_LOG_EMERG 1
+#define NGX_LOG_ALERT 2
+#define NGX_LOG_CRIT 3
+#define NGX_LOG_ERR 4
+#define NGX_LOG_WARN 5
+#define NGX_LOG_NOTICE 6
+#define NGX_LOG_INFO 7
+#define NGX_LOG_DEBUG 8
+#define NGX_LOG_DEBUG_HTTP 0x100
+#define NGX_ALIGNMENT sizeof(unsigned long)
+#define NGX_MODULE_V1 0, 0, NULL, 0, 0, 1, ""
+#define NGX_MODULE_V1_PADDING 0, 0, 0, 0, 0, 0, 0, 0
+#define NGX_HTTP_MODULE 0x50545448
+#define NGX_HTTP_MAIN_CONF 0x02000000
+#define NGX_HTTP_SRV_CONF 0x04000000
+#define NGX_HTTP_LOC_CONF 0x08000000
+#define NGX_CONF_NOARGS 0x00000001
+#define NGX_CONF_TAKE1 0x00000002
+#define NGX_CONF_TAKE2 0x00000004
+#define NGX_CONF_TAKE3 0x00000008
+#define NGX_CONF_TAKE12 (NGX_CONF_TAKE1|NGX_CONF_TAKE2)
+#define NGX_CONF_TAKE23 (NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_TAKE123 (NGX_CONF_TAKE1|NGX_CONF_TAKE2|NGX_CONF_TAKE3)
+#define NGX_CONF_1MORE 0x00000800
+#define NGX_CONF_FLAG 0x00000200
+#define NGX_HTTP_MAIN_CONF_OFFSET 0
+#define NGX_HTTP_SRV_CONF_OFFSET 8
+#define NGX_HTTP_LOC_CONF_OFFSET 16
+#define NGX_HTTP_GET 0x0002
+#define NGX_HTTP_HEAD 0x0004
+#define NGX_HTTP_OK 200
+#define NGX_HTTP_PARTIAL_CONTENT 206
+#define NGX_HTTP_VERSION_10 1000
+#define NGX_HTTP_NOT_MODIFIED 304
+#define NGX_HTTP_NOT_ALLOWED 405
+#define NGX_HTTP_NOT_FOUND 404
+#define NGX_HTTP_FORBIDDEN 403
+#define NGX_HTTP_RANGE_NOT_SATISFIABLE 416
+#define NGX_HTTP_INTERNAL_SERVER_ERROR 500
+#define NGX_HTTP_UNSUPPORTED_MEDIA_TYPE 415
+#define NGX_HTTP_SERVICE_UNAVAILABLE 503
+#define NGX_HTTP_LAST 1
+#define NGX_ETIMEDOUT ETIMEDOUT
+#define NGX_HTTP_REQUEST_TIME_OUT 408
+#define NGX_HTTP_FLUSH 2
+#define NGX_OFF_T_LEN 20
+#define NGX_INT_T_LEN 20
+#define NGX_ATOMIC_T_LEN 20
+#define NGX_FILE_RDONLY O_RDONLY
+#define NGX_FILE_WRONLY O_WRONLY
+#define NGX_FILE_CREATE_OR_OPEN O_CREAT
+#define NGX_FILE_TRUNCATE (O_CREAT|O_TRUNC)
+#define NGX_FILE_OPEN 0
+#define NGX_FILE_DEFAULT_ACCESS 0644
+#define NGX_FILE_NONBLOCK O_NONBLOCK
+#define ngx_open_file_n "open()"
+#define ngx_close_file_n "close()"
+#define ngx_rename_file_n "rename()"
+#define ngx_delete_file_n "unlink()"
+#define ngx_fd_info_n "fstat()"
+#define NGX_READ_EVENT 0
+#define NGX_CLEAR_EVENT 0x80000000
+#define NGX_EAGAIN EAGAIN
+#define NGX_ESRCH ESRCH
+#define NGX_CLOSE_EVENT 1
+#define NGX_LEVEL_EVENT 0
+#define LF '\n'
+
+#define ngx_errno errno
+#define ngx_pagesize 4096
+#define ngx_cacheline_size 64
+#define ngx_pid getpid()
+#define ngx_align(d, a) (((d) + (a - 1)) & ~(a - 1))
+#define ngx_align_ptr(p, a) (u_char *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
+#define ngx_min(a, b) ((a < b) ? a : b)
+#define ngx_max(a, b) ((a < b) ? b : a)
+#define ngx_memzero(buf, n) (void) memset(buf, 0, n)
+#define ngx_memset(buf, c, n) (void) memset(buf, c, n)
+#define ngx_memcpy(dst, src, n) (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n) (((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_memcmp(a, b, n) memcmp(a, b, n)
+#define ngx_memn2cmp(a, b, n1, n2) ((n1) == (n2) ? memcmp(a, b, n1) : (int)(n1) - (int)(n2))
+#define ngx_strlen(s) strlen((const char *) s)
+#define ngx_strstr(s1, s2) strstr((const char *) s1, (const char *) s2)
+#define ngx_strncmp(s1, s2, n) strncmp((const char *) s1, (const char *) s2, n)
+#define NGX_INT64_LEN 20
+#define NGX_MAX_PATH 4096
+#define ngx_strchr(s1, c) strchr((const char *) s1, (int) c)
+#define ngx_strcmp(s1, s2) strcmp((const char *) s1, (const char *) s2)
+#define ngx_strlchr(p, last, c) ((u_char *) memchr(p, c, (last) - (p)))
+#define ngx_string(str) { sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string { 0, NULL }
+#define ngx_str_set(str, text) (str)->len = sizeof(text) - 1; (str)->data = (u_char *) text
+#define ngx_null_command { ngx_null_string, 0, NULL, 0, 0, NULL }
+#define ngx_tolower(c) (u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+#define ngx_hash(key, c) ((ngx_uint_t) key * 31 + c)
+#define ngx_close_file close
+#define ngx_delete_file(name) unlink((const char *) name)
+#define ngx_rename_file(o, n) rename((const char *) o, (const char *) n)
+#define ngx_fd_info(fd, sb) fstat(fd, sb)
+#define ngx_file_size(sb) (sb)->st_size
+#define ngx_file_mtime(sb) (sb)->st_mtime
+#define ngx_file_uniq(sb) (sb)->st_ino
+#define ngx_open_file(name, mode, create, access) open((const char *) name, mode|create, access)
+#define ngx_atomic_fetch_add(value, add) __sync_fetch_and_add(value, add)
+#define ngx_atomic_cmp_set(lock, old, set) __sync_bool_compare_and_swap(lock, old, set)
+#define ngx_spinlock(lock, value, spin) while(!ngx_atomic_cmp_set(lock, 0, value)) {}
+#define ngx_unlock(lock) *(lock) = 0
+#define ngx_memory_barrier() __sync_synchronize()
+#define ngx_log_debug0(l, log, e, f)
+#define ngx_log_debug1(l, log, e, f, a)
+#define ngx_log_debug2(l, log, e, f, a, b)
+#define ngx_log_debug3(l, log, e, f, a, b, c)
+#define ngx_log_debug4(l, log, e, f, a, b, c, d)
+#define ngx_log_debug5(l, log, e, f, a, b, c, d, e2)
+
+typedef struct { size_t len; u_char *data; } ngx_str_t;
+
+typedef struct ngx_log_s { ngx_uint_t log_level; char *action; } ngx_log_t;
+
+typedef void (*ngx_pool_cleanup_pt)(void *data);
+typedef struct ngx_pool_cleanup_s ngx_pool_cleanup_t;
+struct ngx_pool_cleanup_s { ngx_pool_cleanup_pt handler; void *data; ngx_pool_cleanup_t *next; };
+typedef struct ngx_pool_s { ngx_log_t *log; ngx_pool_cleanup_t *cleanup; } ngx_pool_t;
+
+typedef struct ngx_array_s { void *elts; ngx_uint_t nelts; size_t size; ngx_uint_t nalloc; ngx_pool_t *pool; } ngx_array_t;
+typedef struct ngx_list_part_s ngx_list_part_t;
+struct ngx_list_part_s { void *elts; ngx_uint_t nelts; ngx_list_part_t *next; };
+typedef struct { ngx_list_part_t *last; ngx_list_part_t part; size_t size; ngx_uint_t nalloc; ngx_pool_t *pool; } ngx_list_t;
+typedef struct ngx_queue_s ngx_queue_t;
+struct ngx_queue_s { ngx_queue_t *prev; ngx_queue_t *next; };
+
+typedef struct ngx_file_s {
+  ngx_fd_t fd; ngx_str_t name; ngx_file_info_t info; off_t offset; off_t sys_offset; ngx_log_t *log;
+  unsigned directio:1;
+} ngx_file_t;
+
+typedef void *ngx_buf_tag_t;
+typedef struct ngx_buf_s ngx_buf_t;
+struct ngx_buf_s {
+  u_char *pos; u_char *last; off_t file_pos; off_t file_last; u_char *start; u_char *end;
+  ngx_buf_tag_t tag; ngx_file_t *file; ngx_buf_t *shadow;
+  unsigned temporary:1; unsigned memory:1; unsigned mmap:1; unsigned recycled:1; unsigned in_file:1;
+  unsigned flush:1; unsigned sync:1; unsigned last_buf:1; unsigned last_in_chain:1;
+};
+typedef struct ngx_chain_s ngx_chain_t;
+struct ngx_chain_s { ngx_buf_t *buf; ngx_chain_t *next; };
+#define ngx_buf_size(b) ((off_t) ((b)->last - (b)->pos))
+#define ngx_buf_in_memory(b) ((b)->temporary || (b)->memory || (b)->mmap)
+
+typedef struct ngx_event_s ngx_event_t;
+typedef void (*ngx_event_handler_pt)(ngx_event_t *ev);
+typedef struct ngx_rbtree_node_s ngx_rbtree_node_t;
+struct ngx_rbtree_node_s { ngx_rbtree_key_t key; ngx_rbtree_node_t *left; ngx_rbtree_node_t *right; ngx_rbtree_node_t *parent; u_char color; u_char data; };
+typedef struct ngx_rbtree_s ngx_rbtree_t;
+typedef void (*ngx_rbtree_insert_pt)(ngx_rbtree_node_t *root, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+struct ngx_rbtree_s { ngx_rbtree_node_t *root; ngx_rbtree_node_t *sentinel; ngx_rbtree_insert_pt insert; };
+struct ngx_event_s {
+  void *data; unsigned write:1; unsigned active:1; unsigned ready:1; unsigned timedout:1; unsigned timer_set:1;
+  unsigned delayed:1; unsigned complete:1; unsigned cancelable:1; unsigned posted:1;
+  ngx_event_handler_pt handler; ngx_log_t *log; ngx_rbtree_node_t timer; ngx_queue_t queue;
+};
+
+typedef struct ngx_connection_s {
+  unsigned timedout:1; unsigned buffered:8;
+  void *data; ngx_event_t *read; ngx_event_t *write; ngx_fd_t fd; ngx_log_t *log; ngx_pool_t *pool;
+  unsigned destroyed:1; unsigned error:1;
+} ngx_connection_t;
+
+typedef struct {
+  ngx_fd_t fd; ngx_file_uniq_t uniq; time_t mtime; off_t size; off_t fs_size; off_t directio; size_t read_ahead;
+  ngx_err_t err; char *failed; time_t valid; ngx_uint_t min_uses;
+  unsigned test_dir:1; unsigned test_only:1; unsigned log:1; unsigned errors:1; unsigned events:1;
+  unsigned is_dir:1; unsigned is_file:1; unsigned is_link:1; unsigned is_exec:1; unsigned is_directio:1;
+} ngx_open_file_info_t;
+typedef struct ngx_open_file_cache_s ngx_open_file_cache_t;
+
+typedef struct ngx_shm_zone_s ngx_shm_zone_t;
+typedef ngx_int_t (*ngx_shm_zone_init_pt)(ngx_shm_zone_t *zone, void *data);
+typedef struct { u_char *addr; size_t size; ngx_str_t name; ngx_log_t *log; ngx_uint_t exists; } ngx_shm_t;
+struct ngx_shm_zone_s { void *data; ngx_shm_t shm; ngx_shm_zone_init_pt init; void *tag; void *sync; ngx_uint_t noreuse; };
+typedef struct { ngx_atomic_t lock; ngx_atomic_t wait; } ngx_shmtx_sh_t;
+typedef struct { ngx_atomic_t *lock; } ngx_shmtx_t;
+typedef struct ngx_slab_page_s ngx_slab_page_t;
+struct ngx_slab_page_s { uintptr_t slab; ngx_slab_page_t *next; uintptr_t prev; };
+typedef struct {
+  ngx_shmtx_sh_t lock; size_t min_size; size_t min_shift; ngx_slab_page_t *pages; ngx_slab_page_t *last; ngx_slab_page_t free;
+  void *stats; ngx_uint_t pfree; u_char *start; u_char *end; ngx_shmtx_t mutex; u_char *log_ctx; u_char zero;
+  unsigned log_nomem:1; void *data; void *addr;
+} ngx_slab_pool_t;
+
+typedef struct ngx_conf_s ngx_conf_t;
+typedef struct ngx_command_s ngx_command_t;
+struct ngx_command_s { ngx_str_t name; ngx_uint_t type; char *(*set)(ngx_conf_t *cf, ngx_command_t *cmd, void *conf); ngx_uint_t conf; ngx_uint_t offset; void *post; };
+typedef struct ngx_cycle_s { void **conf_ctx; ngx_pool_t *pool; ngx_log_t *log; } ngx_cycle_t;
+struct ngx_conf_s { char *name; ngx_array_t *args; ngx_cycle_t *cycle; ngx_pool_t *pool; ngx_pool_t *temp_pool; ngx_log_t *log; void *ctx; };
+typedef struct ngx_module_s {
+  ngx_uint_t ctx_index, index; char *name; ngx_uint_t spare0, spare1, version; const char *signature;
+  void *ctx; ngx_command_t *commands; ngx_uint_t type;
+  ngx_int_t (*init_master)(ngx_log_t *log); ngx_int_t (*init_module)(ngx_cycle_t *cycle); ngx_int_t (*init_process)(ngx_cycle_t *cycle);
+  ngx_int_t (*init_thread)(ngx_cycle_t *cycle); void (*exit_thread)(ngx_cycle_t *cycle); void (*exit_process)(ngx_cycle_t *cycle); void (*exit_master)(ngx_cycle_t *cycle);
+  uintptr_t s0, s1, s2, s3, s4, s5, s6, s7;
+} ngx_module_t;
+typedef struct { ngx_int_t (*preconfiguration)(ngx_conf_t *cf); ngx_int_t (*postconfiguration)(ngx_conf_t *cf);
+  void *(*create_main_conf)(ngx_conf_t *cf); char *(*init_main_conf)(ngx_conf_t *cf, void *conf);
+  void *(*create_srv_conf)(ngx_conf_t *cf); char *(*merge_srv_conf)(ngx_conf_t *cf, void *prev, void *conf);
+  void *(*create_loc_conf)(ngx_conf_t *cf); char *(*merge_loc_conf)(ngx_conf_t *cf, void *prev, void *conf); } ngx_http_module_t;
+
+typedef struct ngx_thread_task_s ngx_thread_task_t;
+struct ngx_thread_task_s { ngx_thread_task_t *next; ngx_uint_t id; void *ctx; void (*handler)(void *data, ngx_log_t *log); ngx_event_t event; };
+typedef struct ngx_thread_pool_s ngx_thread_pool_t;
+
+typedef struct ngx_table_elt_s ngx_table_elt_t;
+struct ngx_table_elt_s { ngx_uint_t hash; ngx_str_t key; ngx_str_t value; u_char *lowcase_key; ngx_table_elt_t *next; };
+
+typedef struct { ngx_list_t headers; ngx_str_t server; ngx_table_elt_t *range; ngx_table_elt_t *if_modified_since; ngx_table_elt_t *if_none_match; ngx_table_elt_t *if_range; ngx_table_elt_t *if_unmodified_since; ngx_table_elt_t *if_match; } ngx_http_headers_in_t;
+typedef struct { ngx_list_t headers; ngx_uint_t status; ngx_str_t status_line; ngx_str_t content_type; size_t content_type_len;
+  off_t content_length_n; time_t last_modified_time; ngx_table_elt_t *content_range; ngx_table_elt_t *etag; } ngx_http_headers_out_t;
+
+typedef struct ngx_http_request_s ngx_http_request_t;
+typedef void (*ngx_http_event_handler_pt)(ngx_http_request_t *r);
+typedef ngx_int_t (*ngx_http_handler_pt)(ngx_http_request_t *r);
+typedef void (*ngx_http_cleanup_pt)(void *data);
+typedef struct ngx_http_cleanup_s ngx_http_cleanup_t;
+struct ngx_http_cleanup_s { ngx_http_cleanup_pt handler; void *data; ngx_http_cleanup_t *next; };
+struct ngx_http_request_s {
+  ngx_uint_t http_version;
+  ngx_connection_t *connection; void **ctx; void **main_conf; void **srv_conf; void **loc_conf;
+  ngx_http_event_handler_pt read_event_handler; ngx_http_event_handler_pt write_event_handler;
+  ngx_http_request_t *main; ngx_http_request_t *parent; ngx_pool_t *pool;
+  ngx_http_headers_in_t headers_in; ngx_http_headers_out_t headers_out; ngx_chain_t *out;
+  ngx_uint_t method; ngx_str_t uri; ngx_str_t args; ngx_str_t exten; ngx_str_t unparsed_uri;
+  ngx_http_cleanup_t *cleanup; unsigned count:16; unsigned blocked:8; unsigned aio:1;
+  unsigned allow_ranges:1; unsigned single_range:1; unsigned root_tested:1; unsigned error_page:1; unsigned header_only:1; unsigned header_sent:1;
+  unsigned buffered:4; unsigned done:1;
+};
+typedef struct { ngx_str_t name; ngx_http_handler_pt handler; ngx_open_file_cache_t *open_file_cache; size_t read_ahead; time_t open_file_cache_valid;
+  ngx_uint_t open_file_cache_min_uses; ngx_flag_t open_file_cache_errors; ngx_flag_t open_file_cache_events; ngx_flag_t log_not_found;
+  off_t directio; off_t directio_alignment; ngx_msec_t send_timeout; size_t send_lowat; size_t sendfile_max_chunk; } ngx_http_core_loc_conf_t;
+
+extern ngx_module_t ngx_http_core_module;
+extern ngx_cycle_t *ngx_cycle;
+extern ngx_uint_t ngx_ncpu;
+extern volatile ngx_msec_t ngx_current_msec;
+extern volatile time_t ngx_time_v;
+#define ngx_time() time(NULL)
+
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pnalloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment);
+ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p);
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size);
+void *ngx_alloc(size_t size, ngx_log_t *log);
+void *ngx_calloc(size_t size, ngx_log_t *log);
+#define ngx_free free
+void *ngx_array_push(ngx_array_t *a);
+ngx_int_t ngx_array_init(ngx_array_t *a, ngx_pool_t *p, ngx_uint_t n, size_t size);
+ngx_array_t *ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size);
+void *ngx_list_push(ngx_list_t *list);
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n);
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size);
+#define ngx_calloc_buf(pool) ngx_pcalloc(pool, sizeof(ngx_buf_t))
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *pool);
+#define ngx_free_chain(pool, cl) (void)(cl)
+void ngx_chain_update_chains(ngx_pool_t *p, ngx_chain_t **free, ngx_chain_t **busy, ngx_chain_t **out, ngx_buf_tag_t tag);
+#define ngx_qsort qsort
+ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset);
+ssize_t ngx_write_fd(ngx_fd_t fd, void *buf, size_t n);
+ngx_int_t ngx_directio_on(ngx_fd_t fd);
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
+void ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...);
+void ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...);
+uint32_t ngx_crc32_short(u_char *p, size_t len);
+ngx_int_t ngx_atoi(u_char *line, size_t n);
+ssize_t ngx_parse_size(ngx_str_t *line);
+off_t ngx_parse_offset(ngx_str_t *line);
+ngx_int_t ngx_parse_time(ngx_str_t *line, ngx_uint_t is_sec);
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag);
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
+void ngx_shmtx_lock(ngx_shmtx_t *mtx);
+void ngx_shmtx_unlock(ngx_shmtx_t *mtx);
+void ngx_rbtree_init_stub(void);
+typedef struct { ngx_rbtree_node_t node; ngx_str_t str; } ngx_str_node_t;
+void ngx_str_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+ngx_str_node_t *ngx_str_rbtree_lookup(ngx_rbtree_t *rbtree, ngx_str_t *name, uint32_t hash);
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
+void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_insert_value(ngx_rbtree_node_t *root, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+#define ngx_rbt_red(node) ((node)->color = 1)
+#define ngx_rbt_black(node) ((node)->color = 0)
+#define ngx_rbtree_sentinel_init(node) ngx_rbt_black(node)
+#define ngx_rbtree_init(tree, s, i) ngx_rbtree_sentinel_init(s); (tree)->root = s; (tree)->sentinel = s; (tree)->insert = i
+#define ngx_queue_init(q) (q)->prev = q; (q)->next = q
+#define ngx_queue_empty(h) (h == (h)->prev)
+#define ngx_queue_insert_head(h, x) (x)->next = (h)->next; (x)->next->prev = x; (x)->prev = h; (h)->next = x
+#define ngx_queue_insert_tail(h, x) (x)->prev = (h)->prev; (x)->prev->next = x; (x)->next = h; (h)->prev = x
+#define ngx_queue_head(h) (h)->next
+#define ngx_queue_last(h) (h)->prev
+#define ngx_queue_sentinel(h) (h)
+#define ngx_queue_next(q) (q)->next
+#define ngx_queue_prev(q) (q)->prev
+#define ngx_queue_remove(x) (x)->next->prev = (x)->prev; (x)->prev->next = (x)->next
+#define ngx_queue_data(q, type, link) (type *) ((u_char *) q - offsetof(type, link))
+void ngx_add_timer(ngx_event_t *ev, ngx_msec_t timer);
+void ngx_del_timer(ngx_event_t *ev);
+ngx_int_t ngx_handle_write_event(ngx_event_t *wev, size_t lowat);
+void ngx_post_event(ngx_event_t *ev, ngx_queue_t *q);
+extern ngx_queue_t ngx_posted_events;
+ngx_int_t ngx_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+ngx_int_t ngx_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+ngx_connection_t *ngx_get_connection(ngx_fd_t s, ngx_log_t *log);
+void ngx_free_connection(ngx_connection_t *c);
+ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name);
+ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name);
+ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size);
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
+void ngx_stub_run_task(void);
+#define ngx_http_set_log_request(log, r) ((void)(log), (void)(r))
+ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name, ngx_open_file_info_t *of, ngx_pool_t *pool);
+char *ngx_conf_set_num_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_flag_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_size_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_off_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_str_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_conf_set_bufs_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+#define ngx_conf_merge_value(conf, prev, default) if (conf == NGX_CONF_UNSET) { conf = (prev == NGX_CONF_UNSET) ? default : prev; }
+#define ngx_conf_merge_ptr_value(conf, prev, default) if (conf == NGX_CONF_UNSET_PTR) { conf = (prev == NGX_CONF_UNSET_PTR) ? default : prev; }
+#define ngx_conf_merge_uint_value(conf, prev, default) if (conf == NGX_CONF_UNSET_UINT) { conf = (prev == NGX_CONF_UNSET_UINT) ? default : prev; }
+#define ngx_conf_init_uint_value(conf, default) if (conf == NGX_CONF_UNSET_UINT) { conf = default; }
+#define ngx_conf_merge_msec_value(conf, prev, default) if (conf == NGX_CONF_UNSET_MSEC) { conf = (prev == NGX_CONF_UNSET_MSEC) ? default : prev; }
+#define ngx_conf_merge_size_value(conf, prev, default) if (conf == NGX_CONF_UNSET_SIZE) { conf = (prev == NGX_CONF_UNSET_SIZE) ? default : prev; }
+#define ngx_conf_merge_off_value(conf, prev, default) if (conf == NGX_CONF_UNSET) { conf = (prev == NGX_CONF_UNSET) ? default : prev; }
+
+extern void *ngx_stub_loc_conf;
+extern void *ngx_stub_main_conf;
+extern void *ngx_stub_core_loc_conf;
+extern void *ngx_stub_ctx;
+#define ngx_http_get_module_loc_conf(r, module) (module.index == ngx_http_core_module.index ? ngx_stub_core_loc_conf : ngx_stub_loc_conf)
+#define ngx_http_get_module_main_conf(r, module) ngx_stub_main_conf
+#define ngx_http_conf_get_module_loc_conf(cf, module) ngx_stub_core_loc_conf
+#define ngx_http_conf_get_module_main_conf(cf, module) ngx_stub_main_conf
+#define ngx_http_cycle_get_module_main_conf(cycle, module) ngx_stub_main_conf
+#define ngx_http_get_module_ctx(r, module) ngx_stub_ctx
+#define ngx_http_set_ctx(r, c, module) ngx_stub_ctx = c
+
+u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name, size_t *root_length, size_t reserved);
+ngx_int_t ngx_http_discard_request_body(ngx_http_request_t *r);
+ngx_int_t ngx_http_send_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_output_filter(ngx_http_request_t *r, ngx_chain_t *in);
+ngx_int_t ngx_http_set_content_type(ngx_http_request_t *r);
+void ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
+ngx_http_cleanup_t *ngx_http_cleanup_add(ngx_http_request_t *r, size_t size);
+void ngx_http_run_posted_requests(ngx_connection_t *c);
+ngx_int_t ngx_http_send_special(ngx_http_request_t *r, ngx_uint_t flags);
+void ngx_http_request_empty_handler(ngx_http_request_t *r);
+time_t ngx_parse_http_time(u_char *value, size_t len);
+ngx_int_t ngx_http_arg(ngx_http_request_t *r, u_char *name, size_t len, ngx_str_t *value);
+
+#endif
@@ -0,0 +1,244 @@
+/* runtime stubs of the nginx api the tests link against */
+#include <strings.h>
+#include "ngx_core.h"
+
+ngx_module_t ngx_http_core_module = { 0, 99 };
+ngx_cycle_t *ngx_cycle;
+ngx_uint_t ngx_ncpu = 1;
+volatile ngx_msec_t ngx_current_msec;
+ngx_queue_t ngx_posted_events;
+void *ngx_stub_loc_conf, *ngx_stub_main_conf, *ngx_stub_core_loc_conf, *ngx_stub_ctx;
+
+struct stub_blk { struct stub_blk *next; size_t size; };
+static struct stub_blk *stub_blocks;
+
+void *ngx_palloc(ngx_pool_t *pool, size_t size) {
+  if(ngx_cycle && pool == ngx_cycle->pool) return calloc(1, size); /* lives as long as the process */
+  struct stub_blk *b = malloc(sizeof(*b) + size + 64);
+  b->next = stub_blocks; b->size = size; stub_blocks = b;
+  return (u_char *)(b + 1) + 16;
+}
+void *ngx_pnalloc(ngx_pool_t *pool, size_t size) { return ngx_palloc(pool, size); }
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size) { void *p = ngx_palloc(pool, size); memset(p, 0, size); return p; }
+void *ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t a) { void *p; (void)pool; if(posix_memalign(&p, a, size)) return NULL; return p; }
+ngx_int_t ngx_pfree(ngx_pool_t *pool, void *p) {
+  (void)pool;
+  struct stub_blk *b;
+  for(b = stub_blocks; b; b = b->next) if((u_char *)(b + 1) + 16 == p) { b->size = 0; break; }
+  return NGX_OK;
+}
+void stub_pool_reset(void) {
+  while(stub_blocks) { struct stub_blk *n = stub_blocks->next; free(stub_blocks); stub_blocks = n; }
+}
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *p, size_t size) {
+  ngx_pool_cleanup_t *c = ngx_pcalloc(p, sizeof(*c));
+  if(size) c->data = ngx_pcalloc(p, size);
+  c->next = p->cleanup; p->cleanup = c; return c;
+}
+void stub_pool_run_cleanups(ngx_pool_t *p) {
+  ngx_pool_cleanup_t *c;
+  for(c = p->cleanup; c; c = c->next) if(c->handler) c->handler(c->data);
+  p->cleanup = NULL;
+}
+void *ngx_alloc(size_t size, ngx_log_t *log) { (void)log; return malloc(size); }
+void *ngx_calloc(size_t size, ngx_log_t *log) { (void)log; return calloc(1, size); }
+void *ngx_array_push(ngx_array_t *a) {
+  if(a->nelts == a->nalloc) { a->nalloc = a->nalloc ? a->nalloc * 2 : 4; a->elts = realloc(a->elts, a->nalloc * a->size); }
+  return (u_char *)a->elts + a->size * a->nelts++;
+}
+ngx_array_t *ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size) {
+  ngx_array_t *a = ngx_pcalloc(p, sizeof(*a)); a->size = size; a->nalloc = n; a->elts = malloc(n * size); a->pool = p; return a;
+}
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n) { return strncasecmp((char *)s1, (char *)s2, n); }
+void *ngx_list_push(ngx_list_t *list) { (void)list; return calloc(1, 256); }
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size) {
+  ngx_buf_t *b = ngx_pcalloc(pool, sizeof(ngx_buf_t)); b->start = ngx_palloc(pool, size); b->pos = b->last = b->start; b->end = b->start + size; b->temporary = 1; return b;
+}
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *pool) { return ngx_pcalloc(pool, sizeof(ngx_chain_t)); }
+void ngx_chain_update_chains(ngx_pool_t *p, ngx_chain_t **free, ngx_chain_t **busy, ngx_chain_t **out, ngx_buf_tag_t tag) {
+  ngx_chain_t *cl;
+  (void)p;
+  if(*out) {
+    if(*busy == NULL) *busy = *out;
+    else { for(cl = *busy; cl->next; cl = cl->next) {} cl->next = *out; }
+    *out = NULL;
+  }
+  while(*busy) {
+    cl = *busy;
+    if(ngx_buf_size(cl->buf) != 0) break;
+    if(cl->buf->tag != tag) { *busy = cl->next; continue; }
+    cl->buf->pos = cl->buf->start; cl->buf->last = cl->buf->start;
+    *busy = cl->next; cl->next = *free; *free = cl;
+  }
+}
+ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset) {
+  ssize_t n = pread(file->fd, buf, size, offset);
+  if(n < 0) return NGX_ERROR;
+  file->offset = offset + n;
+  return n;
+}
+ssize_t ngx_write_fd(ngx_fd_t fd, void *buf, size_t n) { return write(fd, buf, n); }
+ngx_int_t ngx_directio_on(ngx_fd_t fd) { (void)fd; return 0; }
+
+static u_char *stub_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args) {
+  while(*fmt && buf < last) {
+    if(*fmt != '%') { *buf++ = *fmt++; continue; }
+    fmt++;
+    int is_unsigned = 0, width = 0, frac = -1, star = 0; char zero = ' ';
+    if(*fmt == '0') zero = '0';
+    while(*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+    for(;;) {
+      if(*fmt == 'u') { is_unsigned = 1; fmt++; }
+      else if(*fmt == '.') { fmt++; frac = 0; while(*fmt >= '0' && *fmt <= '9') frac = frac * 10 + (*fmt++ - '0'); }
+      else if(*fmt == '*') { star = 1; fmt++; }
+      else break;
+    }
+    char tmp[128]; int64_t i64 = 0; uint64_t u64 = 0; int isnum = 1;
+    switch(*fmt++) {
+    case 's': if(star) { size_t l = va_arg(args, size_t); u_char *s = va_arg(args, u_char *); while(l-- && buf < last) *buf++ = *s++; }
+              else { u_char *s = va_arg(args, u_char *); while(*s && buf < last) *buf++ = *s++; } isnum = 0; break;
+    case 'V': { ngx_str_t *v = va_arg(args, ngx_str_t *); size_t l = v->len; u_char *s = v->data; while(l-- && buf < last) *buf++ = *s++; isnum = 0; break; }
+    case 'd': if(is_unsigned) u64 = va_arg(args, unsigned int); else i64 = va_arg(args, int); break;
+    case 'D': if(is_unsigned) u64 = va_arg(args, uint32_t); else i64 = va_arg(args, int32_t); break;
+    case 'i': if(is_unsigned) u64 = va_arg(args, ngx_uint_t); else i64 = va_arg(args, ngx_int_t); break;
+    case 'z': if(is_unsigned) u64 = va_arg(args, size_t); else i64 = va_arg(args, ssize_t); break;
+    case 'L': if(is_unsigned) u64 = va_arg(args, uint64_t); else i64 = va_arg(args, int64_t); break;
+    case 'O': i64 = va_arg(args, off_t); break;
+    case 'A': u64 = va_arg(args, ngx_atomic_uint_t); is_unsigned = 1; break;
+    case 'T': i64 = va_arg(args, time_t); break;
+    case 'P': i64 = va_arg(args, ngx_pid_t); break;
+    case 'M': u64 = va_arg(args, ngx_msec_t); is_unsigned = 1; break;
+    case 'f': { double f = va_arg(args, double); int n = snprintf(tmp, sizeof(tmp), "%.*f", frac < 0 ? 0 : frac, f); for(int k = 0; k < n && buf < last; k++) *buf++ = tmp[k]; isnum = 0; break; }
+    case 'c': *buf++ = (u_char)va_arg(args, int); isnum = 0; break;
+    case '%': *buf++ = '%'; isnum = 0; break;
+    case 'N': *buf++ = '\n'; isnum = 0; break;
+    case 'Z': *buf++ = '\0'; isnum = 0; break;
+    default: isnum = 0; break;
+    }
+    if(isnum) {
+      int n = is_unsigned ? snprintf(tmp, sizeof(tmp), "%*llu", width, (unsigned long long)u64) : snprintf(tmp, sizeof(tmp), "%*lld", width, (long long)i64);
+      for(int k = 0; k < n && buf < last; k++) *buf++ = (tmp[k] == ' ' ? zero : tmp[k]);
+    }
+  }
+  return buf;
+}
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...) { va_list a; va_start(a, fmt); u_char *p = stub_vslprintf(buf, (u_char *)-1, fmt, a); va_end(a); return p; }
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...) { va_list a; va_start(a, fmt); u_char *p = stub_vslprintf(buf, buf + max, fmt, a); va_end(a); return p; }
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...) { va_list a; va_start(a, fmt); u_char *p = stub_vslprintf(buf, last, fmt, a); va_end(a); return p; }
+int stub_log_level = NGX_LOG_WARN;
+void ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err, const char *fmt, ...) {
+  (void)log; if((int)level > stub_log_level) return;
+  u_char b[1024]; va_list a; va_start(a, fmt); u_char *p = stub_vslprintf(b, b + sizeof(b) - 1, fmt, a); va_end(a); *p = 0;
+  fprintf(stderr, "[log %d] %s (err %d)\n", (int)level, b, err);
+}
+void ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err, const char *fmt, ...) { (void)cf; (void)level; (void)err; fprintf(stderr, "conf: %s\n", fmt); }
+uint32_t ngx_crc32_short(u_char *p, size_t len) { uint32_t c = 0xffffffff; while(len--) { c ^= *p++; for(int k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320 & -(c & 1)); } return c ^ 0xffffffff; }
+ngx_int_t ngx_atoi(u_char *line, size_t n) { ngx_int_t v = 0; if(!n) return NGX_ERROR; while(n--) { if(*line < '0' || *line > '9') return NGX_ERROR; v = v * 10 + (*line++ - '0'); } return v; }
+ssize_t ngx_parse_size(ngx_str_t *line) { (void)line; return 1 << 20; }
+off_t ngx_parse_offset(ngx_str_t *line) { (void)line; return 1 << 20; }
+ngx_int_t ngx_parse_time(ngx_str_t *line, ngx_uint_t s) { (void)line; (void)s; return 1000; }
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag) { (void)cf; (void)name; (void)size; (void)tag; return calloc(1, sizeof(ngx_shm_zone_t)); }
+/* slab: malloc with a byte budget of end - start, used bytes kept in pfree */
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size) {
+  if(pool->end && pool->pfree + size > (size_t)(pool->end - pool->start)) return NULL;
+  size_t *p = malloc(size + 16); p[0] = size; pool->pfree += size; return p + 2;
+}
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size) { return ngx_slab_alloc_locked(pool, size); }
+void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size) { void *p = ngx_slab_alloc_locked(pool, size); if(p) memset(p, 0, size); return p; }
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size) { return ngx_slab_calloc_locked(pool, size); }
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p) { size_t *h = (size_t *)p - 2; pool->pfree -= h[0]; free(h); }
+void ngx_slab_free(ngx_slab_pool_t *pool, void *p) { ngx_slab_free_locked(pool, p); }
+ngx_int_t ngx_array_init(ngx_array_t *a, ngx_pool_t *p, ngx_uint_t n, size_t size) { a->size = size; a->nalloc = n; a->nelts = 0; a->elts = malloc(n * size); a->pool = p; return NGX_OK; }
+void ngx_shmtx_lock(ngx_shmtx_t *mtx) { (void)mtx; }
+void ngx_shmtx_unlock(ngx_shmtx_t *mtx) { (void)mtx; }
+void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node) { node->left = node->right = tree->sentinel; node->parent = NULL; if(tree->root == tree->sentinel) { tree->root = node; node->parent = NULL; } else tree->insert(tree->root, node, tree->sentinel); }
+static void stub_transplant(ngx_rbtree_t *t, ngx_rbtree_node_t *u, ngx_rbtree_node_t *v) {
+  if(u == t->root) t->root = v; else if(u == u->parent->left) u->parent->left = v; else u->parent->right = v;
+  if(v != t->sentinel) v->parent = u->parent;
+}
+void ngx_rbtree_delete(ngx_rbtree_t *t, ngx_rbtree_node_t *z) {
+  ngx_rbtree_node_t *s = t->sentinel;
+  if(z->left == s) stub_transplant(t, z, z->right);
+  else if(z->right == s) stub_transplant(t, z, z->left);
+  else {
+    ngx_rbtree_node_t *y = z->right; while(y->left != s) y = y->left;
+    if(y->parent != z) { stub_transplant(t, y, y->right); y->right = z->right; y->right->parent = y; }
+    stub_transplant(t, z, y); y->left = z->left; y->left->parent = y;
+  }
+}
+void ngx_str_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+  ngx_rbtree_node_t **p;
+  for(;;) {
+    ngx_str_node_t *n = (ngx_str_node_t *)node, *t = (ngx_str_node_t *)temp;
+    if(node->key != temp->key) p = (node->key < temp->key) ? &temp->left : &temp->right;
+    else if(n->str.len != t->str.len) p = (n->str.len < t->str.len) ? &temp->left : &temp->right;
+    else p = (memcmp(n->str.data, t->str.data, n->str.len) < 0) ? &temp->left : &temp->right;
+    if(*p == sentinel) break;
+    temp = *p;
+  }
+  *p = node; node->parent = temp; node->left = sentinel; node->right = sentinel;
+}
+ngx_str_node_t *ngx_str_rbtree_lookup(ngx_rbtree_t *rbtree, ngx_str_t *val, uint32_t hash) {
+  ngx_rbtree_node_t *node = rbtree->root, *sentinel = rbtree->sentinel;
+  while(node != sentinel) {
+    ngx_str_node_t *n = (ngx_str_node_t *)node; ngx_int_t rc;
+    if(hash != node->key) { node = (hash < node->key) ? node->left : node->right; continue; }
+    if(val->len != n->str.len) { node = (val->len < n->str.len) ? node->left : node->right; continue; }
+    rc = memcmp(val->data, n->str.data, val->len);
+    if(rc < 0) { node = node->left; continue; }
+    if(rc > 0) { node = node->right; continue; }
+    return n;
+  }
+  return NULL;
+}
+void ngx_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+  ngx_rbtree_node_t **p;
+  for(;;) { p = (node->key < temp->key) ? &temp->left : &temp->right; if(*p == sentinel) break; temp = *p; }
+  *p = node; node->parent = temp; node->left = sentinel; node->right = sentinel;
+}
+void ngx_add_timer(ngx_event_t *ev, ngx_msec_t t) { (void)t; ev->timer_set = 1; }
+void ngx_del_timer(ngx_event_t *ev) { ev->timer_set = 0; }
+ngx_int_t ngx_handle_write_event(ngx_event_t *wev, size_t lowat) { (void)wev; (void)lowat; return NGX_OK; }
+void ngx_post_event(ngx_event_t *ev, ngx_queue_t *q) { (void)q; ev->posted = 1; }
+ngx_event_t *ngx_stub_read_event;
+ngx_int_t ngx_add_event(ngx_event_t *ev, ngx_int_t e, ngx_uint_t f) { (void)e; (void)f; ngx_stub_read_event = ev; return NGX_OK; }
+ngx_int_t ngx_del_event(ngx_event_t *ev, ngx_int_t e, ngx_uint_t f) { (void)ev; (void)e; (void)f; return NGX_OK; }
+ngx_connection_t *ngx_get_connection(ngx_fd_t s, ngx_log_t *log) { ngx_connection_t *c = calloc(1, sizeof(*c)); c->fd = s; c->log = log; c->read = calloc(1, sizeof(ngx_event_t)); c->write = calloc(1, sizeof(ngx_event_t)); c->read->data = c; c->write->data = c; return c; }
+void ngx_free_connection(ngx_connection_t *c) { (void)c; }
+ngx_thread_pool_t *ngx_thread_pool_add(ngx_conf_t *cf, ngx_str_t *name) { (void)cf; (void)name; return (ngx_thread_pool_t *)1; }
+ngx_thread_pool_t *ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name) { (void)cycle; (void)name; return (ngx_thread_pool_t *)1; }
+ngx_thread_task_t *ngx_thread_task_alloc(ngx_pool_t *pool, size_t size) { ngx_thread_task_t *t = ngx_pcalloc(pool, sizeof(*t) + size); t->ctx = t + 1; return t; }
+#include <pthread.h>
+static void *stub_thread(void *p) { ngx_thread_task_t *t = p; t->handler(t->ctx, NULL); return NULL; }
+ngx_thread_task_t *ngx_stub_task;
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task) { (void)tp; ngx_stub_task = task; return NGX_OK; }
+void ngx_stub_run_task(void) { ngx_thread_task_t *task = ngx_stub_task; pthread_t th; if(!task) return; ngx_stub_task = NULL; pthread_create(&th, NULL, stub_thread, task); pthread_join(th, NULL); task->event.complete = 1; task->event.handler(&task->event); }
+char *ngx_conf_set_num_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_flag_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_size_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_off_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_str_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+char *ngx_conf_set_bufs_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) { (void)cf; (void)cmd; (void)conf; return NGX_CONF_OK; }
+ngx_int_t ngx_http_discard_request_body(ngx_http_request_t *r) { (void)r; return NGX_OK; }
+ngx_int_t ngx_http_send_header(ngx_http_request_t *r) { r->header_sent = 1; if(r->method == NGX_HTTP_HEAD) r->header_only = 1; return NGX_OK; }
+ngx_int_t ngx_http_set_content_type(ngx_http_request_t *r) { (void)r; return NGX_OK; }
+void ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc) { (void)r; (void)rc; }
+ngx_http_cleanup_t *ngx_http_cleanup_add(ngx_http_request_t *r, size_t size) { ngx_http_cleanup_t *c = ngx_pcalloc(r->pool, sizeof(*c)); if(size) c->data = ngx_pcalloc(r->pool, size); c->next = r->cleanup; r->cleanup = c; return c; }
+void ngx_http_run_posted_requests(ngx_connection_t *c) { (void)c; }
+ngx_int_t ngx_http_send_special(ngx_http_request_t *r, ngx_uint_t flags) { (void)r; (void)flags; return NGX_OK; }
+void ngx_http_request_empty_handler(ngx_http_request_t *r) { (void)r; }
+time_t ngx_parse_http_time(u_char *value, size_t len) { (void)value; (void)len; return -1; }
+ngx_int_t ngx_http_arg(ngx_http_request_t *r, u_char *name, size_t len, ngx_str_t *value) { (void)r; (void)name; (void)len; (void)value; return NGX_DECLINED; }
+/* the tests open files themselves and drop the response body */
+u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name, size_t *root_length, size_t reserved) {
+  name->data = ngx_palloc(r->pool, r->uri.len + reserved + 1); memcpy(name->data, r->uri.data, r->uri.len);
+  name->len = r->uri.len; name->data[name->len] = 0; *root_length = 0; return name->data + name->len;
+}
+ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name, ngx_open_file_info_t *of, ngx_pool_t *pool) {
+  struct stat st; (void)cache; (void)pool;
+  of->fd = open((const char *)name->data, O_RDONLY);
+  if(of->fd < 0 || fstat(of->fd, &st)) { of->err = errno; return NGX_ERROR; }
+  of->uniq = st.st_ino; of->mtime = st.st_mtime; of->size = st.st_size; of->is_file = S_ISREG(st.st_mode); return NGX_OK;
+}
+ngx_int_t ngx_http_output_filter(ngx_http_request_t *r, ngx_chain_t *in) { (void)r; for(; in; in = in->next) in->buf->pos = in->buf->last; return NGX_OK; }
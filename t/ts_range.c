@@ -0,0 +1,240 @@
+// Checks that a range of a segment, muxed on its own from the sample that
+// holds its first byte, is the same as that slice of the whole segment. For
+// every segment and audio track of the mp4 files given on the command line
+// the ranges start at several offsets, go through ngx_streaming_range and
+// output_ts_seek, and are muxed in parts like hls_ts_buffer_size does. It
+// runs once as is and once through a small hls_read_window.
+#include "ngx_http_streaming_module.c"
+
+void stub_pool_reset(void);
+void stub_pool_run_cleanups(ngx_pool_t *p);
+
+static ngx_log_t log_;
+static ngx_pool_t pool;
+static ngx_connection_t connection;
+static ngx_http_core_loc_conf_t clcf;
+
+static unsigned int checked, wrong;
+
+#define TS_RANGE_PART (16 * 1024)  // muxed at a time, as hls_ts_buffer_size
+
+static mpegts_muxer_t *ts_range_open(mp4_context_t *mp4_context, segment_t const *segment, u_int audio,
+                                     bucket_t **bucket) {
+  ngx_http_request_t *r = mp4_context->r;
+  mp4_split_options_t *options = mp4_split_options_init(r);
+
+  options->fragments = 1;
+  options->fragment_start = segment->start_;
+  options->fragment_track_id = audio;
+  *bucket = bucket_init(r);
+
+  mpegts_muxer_t *muxer = output_ts_open(mp4_context, *bucket, options);
+  mp4_split_options_exit(r, options);
+
+  return muxer;
+}
+
+// appends the bytes of the chain to data
+static size_t ts_range_copy(u_char *data, size_t size, size_t max, ngx_chain_t const *cl) {
+  for(; cl; cl = cl->next) {
+    size_t n = cl->buf->last - cl->buf->pos;
+    if(size + n > max) n = max - size;
+    memcpy(data + size, cl->buf->pos, n);
+    size += n;
+  }
+
+  return size;
+}
+
+// the whole segment, as it is sent without a range
+static u_char *ts_range_full(mp4_context_t *mp4_context, segment_t const *segment, u_int audio, size_t *size) {
+  bucket_t *bucket;
+  mpegts_muxer_t *muxer = ts_range_open(mp4_context, segment, audio, &bucket);
+  if(muxer == NULL) return NULL;
+
+  int rc = output_ts_read(muxer) ? output_ts_mux(muxer, (uint64_t)-1) : NGX_ERROR;
+  u_char *data = rc == 1 ? malloc(bucket->content_length) : NULL;
+  if(data) *size = ts_range_copy(data, 0, bucket->content_length, bucket->first);
+  output_ts_close(mp4_context, muxer);
+
+  return data;
+}
+
+// muxes the range of value from scratch and compares it with the slice of
+// full, returns 0 if it can't be muxed
+static int ts_range_check(mp4_context_t *mp4_context, segment_t const *segment, u_int audio,
+                          u_char const *full, size_t size, char const *value) {
+  ngx_http_request_t *r = mp4_context->r;
+  ngx_table_elt_t range;
+  hls_ctx_t ctx;
+  bucket_t *bucket;
+
+  mpegts_muxer_t *muxer = ts_range_open(mp4_context, segment, audio, &bucket);
+  if(muxer == NULL) return 0;
+
+  ngx_memzero(&ctx, sizeof(hls_ctx_t));
+  ngx_memzero(&range, sizeof(ngx_table_elt_t));
+  range.value.data = (u_char *)value;
+  range.value.len = strlen(value);
+  r->headers_in.range = &range;
+  r->headers_out.content_length_n = output_ts_size(muxer);
+
+  ngx_int_t rc = ngx_streaming_range(r, &ctx);
+  r->headers_in.range = NULL;
+  ++checked;
+  if(rc != NGX_OK || (size_t)r->headers_out.content_length_n != (size_t)(ctx.range_end - ctx.range_start)) {
+    fprintf(stderr, "%s video=%u&audio=%u: range %s of %zu not taken\n", mp4_context->file->name.data,
+            segment->start_, audio, value, size);
+    output_ts_close(mp4_context, muxer);
+    ++wrong;
+    return 1;
+  }
+
+  size_t start = ctx.range_start, end = ctx.range_end, n = 0;
+  u_char *data = malloc(end - start);
+  int muxed = output_ts_seek(muxer, start) && output_ts_read(muxer) ? 0 : NGX_ERROR;
+
+  // as ngx_streaming_send passes it on
+  while(muxed == 0) {
+    uint64_t part = TS_RANGE_PART;
+    if(part > end - bucket->content_length) part = end - bucket->content_length;
+
+    bucket_reset(bucket);
+    muxed = output_ts_mux(muxer, part);
+    if(muxed == NGX_ERROR) break;
+    if(bucket->content_length >= end) muxed = 1;
+
+    n = ts_range_copy(data, n, end - start, bucket_range(bucket, start, end));
+  }
+  output_ts_close(mp4_context, muxer);
+
+  if(muxed != NGX_ERROR && (n != end - start || memcmp(data, full + start, n))) {
+    fprintf(stderr, "%s video=%u&audio=%u: range %s differs from bytes %zu-%zu of the segment\n",
+            mp4_context->file->name.data, segment->start_, audio, value, start, end - 1);
+    ++wrong;
+  }
+  free(data);
+
+  return muxed != NGX_ERROR;
+}
+
+// ranges from the start, within the first packets, in the middle, to the end
+// and from the end, and a few more at offsets spread over the segment
+static int ts_range_segment(mp4_context_t *mp4_context, segment_t const *segment, u_int audio) {
+  size_t size, i, starts[12];
+  char value[64];
+  int result = 1;
+
+  u_char *full = ts_range_full(mp4_context, segment, audio, &size);
+  if(full == NULL) return 0;
+
+  starts[0] = 0;
+  starts[1] = 1;
+  starts[2] = TS_PACKET_SIZE;
+  starts[3] = 7 * TS_PACKET_SIZE + 5;
+  starts[4] = size / 3;
+  starts[5] = size / 2;
+  starts[6] = size - TS_PACKET_SIZE;
+  starts[7] = size - 1;
+  for(i = 8; i != 12; ++i) starts[i] = (segment->start_ * 7919 + i * 104729) % size;
+
+  for(i = 0; result && i != sizeof(starts) / sizeof(starts[0]); ++i) {
+    if(i % 2) sprintf(value, "bytes=%zu-", starts[i]);
+    else sprintf(value, "bytes=%zu-%zu", starts[i], starts[i] + 40000);
+    result = ts_range_check(mp4_context, segment, audio, full, size, value);
+  }
+  if(result) result = ts_range_check(mp4_context, segment, audio, full, size, "bytes=-1000");
+
+  free(full);
+
+  return result;
+}
+
+static int ts_range_file(ngx_http_request_t *r, char const *name) {
+  ngx_file_t file;
+  ngx_open_file_info_t of;
+  uint32_t i, track_id;
+  int result = 1;
+
+  ngx_memzero(&file, sizeof(ngx_file_t));
+  ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+  file.name.data = (u_char *)name;
+  file.name.len = strlen(name);
+  file.log = &log_;
+  if(ngx_open_cached_file(NULL, &file.name, &of, r->pool) != NGX_OK) {
+    fprintf(stderr, "%s: can't open\n", name);
+    return 0;
+  }
+  file.fd = of.fd;
+
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  mp4_context_t *mp4_context = mp4_open(r, &file, &of, MP4_OPEN_MOOV);
+  if(mp4_context == NULL || !moov_build_segments(mp4_context, mp4_context->moov, conf->length)) {
+    fprintf(stderr, "%s: can't read the moov\n", name);
+    result = 0;
+  } else {
+    moov_t const *moov = mp4_context->moov;
+    for(i = 0; result && i != moov->segments_size_; ++i) {
+      u_int audio_tracks = 0;
+      for(track_id = 0; result && track_id < moov->tracks_; ++track_id) {
+        if(moov->traks_[track_id]->mdia_->hdlr_->handler_type_ != FOURCC('s', 'o', 'u', 'n')) continue;
+        ++audio_tracks;
+        result = ts_range_segment(mp4_context, &moov->segments_[i], track_id);
+      }
+      if(result && !audio_tracks) result = ts_range_segment(mp4_context, &moov->segments_[i], 0);
+    }
+    if(!result) fprintf(stderr, "%s: segment %u can't be muxed\n", name, i - 1);
+  }
+
+  if(mp4_context) mp4_close(mp4_context);
+  stub_pool_run_cleanups(r->pool);
+  stub_pool_reset();
+  close(of.fd);
+
+  return result;
+}
+
+int main(int argc, char **argv) {
+  static ngx_cycle_t cycle;
+  static ngx_pool_t cycle_pool;
+  ngx_http_request_t r;
+  ngx_conf_t cf;
+  int i, result = 1;
+
+  cycle.pool = &cycle_pool;
+  cycle.log = &log_;
+  ngx_cycle = &cycle;
+
+  ngx_memzero(&cf, sizeof(ngx_conf_t));
+  cf.pool = &cycle_pool;
+  cf.log = &log_;
+  ngx_stub_main_conf = ngx_http_hls_create_main_conf(&cf);
+  ngx_http_hls_init_main_conf(&cf, ngx_stub_main_conf);
+
+  hls_conf_t *prev = ngx_http_hls_create_conf(&cf);
+  hls_conf_t *conf = ngx_http_hls_create_conf(&cf);
+  ngx_http_hls_merge_conf(&cf, prev, conf);
+  ngx_stub_loc_conf = conf;
+  ngx_stub_core_loc_conf = &clcf;
+
+  ngx_memzero(&r, sizeof(ngx_http_request_t));
+  pool.log = &log_;
+  connection.log = &log_;
+  r.connection = &connection;
+  r.pool = &pool;
+  r.main = &r;
+  r.http_version = NGX_HTTP_VERSION_10;
+
+  for(i = 1; i < argc; ++i) {
+    conf->read_window = 0;
+    if(!ts_range_file(&r, argv[i])) result = 0;
+    conf->read_window = 64 * 1024;
+    if(!ts_range_file(&r, argv[i])) result = 0;
+  }
+
+  printf("ts_range: %u ranges checked, %u wrong\n", checked, wrong);
+
+  return result && checked && !wrong ? 0 : 1;
+}
+
+// End Of File
@@ -0,0 +1,149 @@
+// Checks that output_ts_size predicts the bytes output_ts_mux writes, for
+// every segment and audio track of the mp4 files given on the command line,
+// and that the segments the table links cover the first trak sample by sample.
+// It runs once as is and once through a small hls_read_window.
+#include "ngx_http_streaming_module.c"
+
+void stub_pool_reset(void);
+void stub_pool_run_cleanups(ngx_pool_t *p);
+
+static ngx_log_t log_;
+static ngx_pool_t pool;
+static ngx_connection_t connection;
+static ngx_http_core_loc_conf_t clcf;
+
+static unsigned int checked, wrong;
+
+// one segment of one audio track, returns 0 if it can't be muxed
+static int ts_size_segment(mp4_context_t *mp4_context, segment_t const *segment, u_int audio) {
+  ngx_http_request_t *r = mp4_context->r;
+  mp4_split_options_t *options = mp4_split_options_init(r);
+  bucket_t *bucket = bucket_init(r);
+
+  options->fragments = 1;
+  options->fragment_start = segment->start_;
+  options->fragment_track_id = audio;
+
+  mpegts_muxer_t *muxer = output_ts_open(mp4_context, bucket, options);
+  if(muxer == NULL) return 0;
+
+  fragment_t const *fragment = &muxer->fragment_[0];
+  if(fragment->trak == mp4_context->moov->traks_[0] &&
+     (fragment->first.sample_ != segment->first_ || fragment->last != segment->last_)) {
+    fprintf(stderr, "%s video=%u: samples %u-%u, the table has %u-%u\n", mp4_context->file->name.data,
+            segment->start_, fragment->first.sample_, fragment->last, segment->first_, segment->last_);
+    ++wrong;
+  }
+
+  uint64_t size = output_ts_size(muxer);
+  int rc = output_ts_read(muxer) ? output_ts_mux(muxer, (uint64_t)-1) : NGX_ERROR;
+  output_ts_close(mp4_context, muxer);
+  mp4_split_options_exit(r, options);
+  if(rc != 1) return 0;
+
+  ++checked;
+  if(size != bucket->content_length) {
+    fprintf(stderr, "%s video=%u&audio=%u: predicted %llu, muxed %llu\n", mp4_context->file->name.data,
+            segment->start_, audio, (unsigned long long)size, (unsigned long long)bucket->content_length);
+    ++wrong;
+  }
+
+  return 1;
+}
+
+static int ts_size_file(ngx_http_request_t *r, char const *name) {
+  ngx_file_t file;
+  ngx_open_file_info_t of;
+  uint32_t i, track_id;
+  int result = 1;
+
+  ngx_memzero(&file, sizeof(ngx_file_t));
+  ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+  file.name.data = (u_char *)name;
+  file.name.len = strlen(name);
+  file.log = &log_;
+  if(ngx_open_cached_file(NULL, &file.name, &of, r->pool) != NGX_OK) {
+    fprintf(stderr, "%s: can't open\n", name);
+    return 0;
+  }
+  file.fd = of.fd;
+
+  hls_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_streaming_module);
+  mp4_context_t *mp4_context = mp4_open(r, &file, &of, MP4_OPEN_MOOV);
+  if(mp4_context == NULL || !moov_build_segments(mp4_context, mp4_context->moov, conf->length)) {
+    fprintf(stderr, "%s: can't read the moov\n", name);
+    result = 0;
+  } else {
+    moov_t const *moov = mp4_context->moov;
+    for(i = 0; result && i != moov->segments_size_; ++i) {
+      segment_t const *segment = &moov->segments_[i];
+      unsigned int first = i ? segment[-1].last_ : 0;
+      unsigned int last = i + 1 == moov->segments_size_ ? moov->traks_[0]->samples_size_ : segment->last_;
+      if(segment->first_ != first || segment->last_ != last || (i && segment->start_ <= segment[-1].start_)) {
+        fprintf(stderr, "%s: segment %u is samples %u-%u from sync sample %u\n", name, i,
+                segment->first_, segment->last_, segment->start_);
+        ++wrong;
+      }
+
+      u_int audio_tracks = 0;
+      for(track_id = 0; result && track_id < moov->tracks_; ++track_id) {
+        if(moov->traks_[track_id]->mdia_->hdlr_->handler_type_ != FOURCC('s', 'o', 'u', 'n')) continue;
+        ++audio_tracks;
+        result = ts_size_segment(mp4_context, segment, track_id);
+      }
+      if(result && !audio_tracks) result = ts_size_segment(mp4_context, segment, 0);
+    }
+    if(!result) fprintf(stderr, "%s: segment %u can't be muxed\n", name, i - 1);
+  }
+
+  if(mp4_context) mp4_close(mp4_context);
+  stub_pool_run_cleanups(r->pool);
+  stub_pool_reset();
+  close(of.fd);
+
+  return result;
+}
+
+int main(int argc, char **argv) {
+  static ngx_cycle_t cycle;
+  static ngx_pool_t cycle_pool;
+  ngx_http_request_t r;
+  ngx_conf_t cf;
+  int i, result = 1;
+
+  cycle.pool = &cycle_pool;
+  cycle.log = &log_;
+  ngx_cycle = &cycle;
+
+  ngx_memzero(&cf, sizeof(ngx_conf_t));
+  cf.pool = &cycle_pool;
+  cf.log = &log_;
+  ngx_stub_main_conf = ngx_http_hls_create_main_conf(&cf);
+  ngx_http_hls_init_main_conf(&cf, ngx_stub_main_conf);
+
+  hls_conf_t *prev = ngx_http_hls_create_conf(&cf);
+  hls_conf_t *conf = ngx_http_hls_create_conf(&cf);
+  ngx_http_hls_merge_conf(&cf, prev, conf);
+  ngx_stub_loc_conf = conf;
+  ngx_stub_core_loc_conf = &clcf;
+
+  ngx_memzero(&r, sizeof(ngx_http_request_t));
+  pool.log = &log_;
+  connection.log = &log_;
+  r.connection = &connection;
+  r.pool = &pool;
+  r.main = &r;
+
+  for(i = 1; i < argc; ++i) {
+    conf->read_window = 0;
+    if(!ts_size_file(&r, argv[i])) result = 0;
+    conf->read_window = 64 * 1024;
+    if(!ts_size_file(&r, argv[i])) result = 0;
+  }
+
+  printf("ts_size: %u segments checked, %u wrong\n", checked, wrong);
+
+  return result && checked && !wrong ? 0 : 1;
+}
+
+// End Of File